@@ -21,7 +21,7 @@ CFLAGS := $(CFLAGS) $(CCOMMONFLAGS) -std=gnu2x -gdwarf-4
 
 CXXFLAGS := $(CXXFLAGS) $(CCOMMONFLAGS) -std=gnu++2a \
        -fno-exceptions -fno-rtti -gdwarf-4 -ffunction-sections
-KERNELCXXFLAGS := $(CXXFLAGS) -mno-red-zone $(SANITIZEFLAGS)
+KERNELCXXFLAGS := $(CXXFLAGS) -mno-red-zone -fdata-sections $(SANITIZEFLAGS)
 
 ASFLAGS := $(CCOMMONFLAGS)
 
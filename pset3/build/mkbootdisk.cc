@@ -5,6 +5,7 @@
 #include <fcntl.h>
 #include "elf.h"
 #include <unistd.h>
+#include <sys/stat.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -23,11 +24,16 @@
  * two bytes in the sector equal 0x55 and 0xAA.
  * This code makes sure the code intended for the boot sector is at most
  * 512 - 2 = 510 bytes long, then appends the 0x55-0xAA signature.
+ *
+ * With `-o IMAGE`, the image is updated in place: each sector is compared
+ * with the existing image, and only sectors that changed are rewritten.
+ * Rebuilding after a small kernel change then writes only a few sectors.
  */
 
 int diskfd;
 off_t maxoff = 0;
 off_t curoff = 0;
+int incremental = 0;    // `-o`: rewrite only changed sectors
 
 int find_partition(off_t partition_sect, off_t extended_sect, int partoff);
 void do_multiboot(const char *filename);
@@ -35,6 +41,7 @@ void do_multiboot(const char *filename);
 
 void usage(void) {
     fprintf(stderr, "Usage: mkbootdisk BOOTSECTORFILE [FILE | @SECNUM]...\n");
+    fprintf(stderr, "   or: mkbootdisk -o IMAGE BOOTSECTORFILE [FILE | @SECNUM]...\n");
     fprintf(stderr, "   or: mkbootdisk -p DISK [FILE | @SECNUM]...\n");
     fprintf(stderr, "   or: mkbootdisk -m KERNELFILE\n");
     exit(1);
@@ -49,11 +56,67 @@ FILE *fopencheck(const char *name) {
     return f;
 }
 
+void diskpwrite(const void *data, size_t amt, off_t off) {
+    while (amt > 0) {
+        ssize_t w = pwrite(diskfd, data, amt, off);
+        if (w == -1 && errno != EINTR) {
+            perror("pwrite");
+            usage();
+        } else if (w == 0) {
+            fprintf(stderr, "pwrite hit end of file\n");
+            usage();
+        } else if (w > 0) {
+            amt -= w;
+            off += w;
+            data = (const unsigned char *) data + w;
+        }
+    }
+}
+
+// Write `data` at `curoff`, skipping 512-byte sectors whose contents
+// already match the image. Adjacent changed sectors are written together.
+void diskwrite_changed(const void *data, size_t amt) {
+    const unsigned char *p = (const unsigned char *) data;
+    unsigned char old[4096];
+    while (amt > 0) {
+        size_t n = amt < sizeof(old) ? amt : sizeof(old);
+        ssize_t r;
+        do {
+            r = pread(diskfd, old, n, curoff);
+        } while (r == -1 && errno == EINTR);
+        if (r == -1) {
+            perror("pread");
+            usage();
+        }
+
+        size_t dirty_start = n, dirty_end = 0;
+        for (size_t off = 0; off < n; off += 512) {
+            size_t len = n - off < 512 ? n - off : 512;
+            if (off + len > size_t(r) || memcmp(p + off, old + off, len) != 0) {
+                dirty_start = dirty_start < off ? dirty_start : off;
+                dirty_end = off + len;
+            }
+        }
+        if (dirty_start < dirty_end) {
+            diskpwrite(p + dirty_start, dirty_end - dirty_start,
+                       curoff + dirty_start);
+        }
+
+        amt -= n;
+        curoff += n;
+        p += n;
+    }
+}
+
 void diskwrite(const void *data, size_t amt) {
     if (maxoff && curoff + amt > size_t(maxoff)) {
         fprintf(stderr, "more data than allowed in partition!\n");
         usage();
     }
+    if (incremental) {
+        diskwrite_changed(data, amt);
+        return;
+    }
 
     while (amt > 0) {
         ssize_t w = write(diskfd, data, amt);
@@ -106,6 +169,20 @@ int main(int argc, char *argv[]) {
         bootsector_special = 0;
     }
 
+    // Check for an output image to update in place
+    if (argc >= 2 && strcmp(argv[1], "-o") == 0) {
+        if (argc < 3) {
+            usage();
+        }
+        if ((diskfd = open(argv[2], O_RDWR | O_CREAT, 0666)) < 0) {
+            fprintf(stderr, "%s: %s\n", argv[2], strerror(errno));
+            usage();
+        }
+        incremental = 1;
+        argc -= 2;
+        argv += 2;
+    }
+
     // Check for multiboot option
     if (argc >= 2 && strcmp(argv[1], "-m") == 0) {
         if (argc < 3) {
@@ -184,6 +261,19 @@ int main(int argc, char *argv[]) {
         nsectors++;
     }
 
+    // Drop any tail left from a larger old image, and mark the image as
+    // up to date even if no sector changed
+    if (incremental) {
+        if (ftruncate(diskfd, curoff) != 0) {
+            perror("ftruncate");
+            usage();
+        }
+        if (futimens(diskfd, nullptr) != 0) {
+            perror("futimens");
+            usage();
+        }
+    }
+
     return 0;
 }
 
@@ -24,11 +24,17 @@
 
 static bool verbose = false;
 
+// An `elf_info` either reads the ELF file into a growable buffer, or
+// (`map()`) maps a regular file and edits it in place. A mapped file
+// grows by extending the file, so growing moves only the data after
+// the shift point, and only pages that change are written back.
+
 struct elf_info {
     const char* filename_;
     char* data_ = nullptr;
     size_t size_ = 0;
     size_t capacity_ = 0;
+    int fd_ = -1;               // file descriptor for mapped file
     bool changed_ = false;
 
     bool ok_ = false;
@@ -39,6 +45,7 @@ struct elf_info {
     mutable unsigned nsymtab_ = 0;
     mutable const char* symstrtab_;
 
+    bool map(int fd, size_t size);
     void grow(size_t capacity);
 
     bool validate();
@@ -54,8 +61,40 @@ struct elf_info {
 };
 
 
+bool elf_info::map(int fd, size_t size) {
+    assert(!data_);
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      fd, 0);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    data_ = reinterpret_cast<char*>(data);
+    size_ = capacity_ = size;
+    fd_ = fd;
+    return true;
+}
+
 void elf_info::grow(size_t capacity) {
-    if (capacity > capacity_) {
+    if (capacity <= capacity_) {
+        return;
+    }
+    if (fd_ >= 0) {
+        // The mapping covers exactly the file, so extend the file and
+        // map it again.
+        if (ftruncate(fd_, capacity) != 0) {
+            fprintf(stderr, "%s: %s\n", filename_, strerror(errno));
+            exit(1);
+        }
+        munmap(data_, capacity_);
+        void* data = mmap(nullptr, capacity, PROT_READ | PROT_WRITE,
+                          MAP_SHARED, fd_, 0);
+        if (data == MAP_FAILED) {
+            fprintf(stderr, "%s: %s\n", filename_, strerror(errno));
+            exit(1);
+        }
+        data_ = reinterpret_cast<char*>(data);
+        capacity_ = capacity;
+    } else {
         capacity = std::max(capacity, capacity_ + 32768);
         char* data = new char[capacity];
         if (capacity_ != 0) {
@@ -64,13 +103,13 @@ void elf_info::grow(size_t capacity) {
         delete[] data_;
         data_ = data;
         capacity_ = capacity;
-        if (ok_) {
-            eh_ = reinterpret_cast<elf_header*>(data_);
-            pht_ = reinterpret_cast<elf_program*>(data_ + eh_->e_phoff);
-            sht_ = reinterpret_cast<elf_section*>(data_ + eh_->e_shoff);
-            symtab_ = nullptr;
-            nsymtab_ = 0;
-        }
+    }
+    if (ok_) {
+        eh_ = reinterpret_cast<elf_header*>(data_);
+        pht_ = reinterpret_cast<elf_program*>(data_ + eh_->e_phoff);
+        sht_ = reinterpret_cast<elf_section*>(data_ + eh_->e_shoff);
+        symtab_ = nullptr;
+        nsymtab_ = 0;
     }
 }
 
@@ -333,9 +372,73 @@ static void usage() {
     exit(1);
 }
 
+// Return an address index (`elf_symindex` and its arrays) for the sorted
+// symbol table. Only symbols in loaded sections are indexed. A symbol
+// extends to the next indexed symbol (or 4096 bytes, if it is last), but
+// no more than 1 byte past its size, matching the old binary search.
+static std::vector<char> build_symindex(const elf_info& ei) {
+    elf_symbol* sym = ei.symtab();
+    std::vector<unsigned> syms;
+    for (unsigned i = 1; i != ei.nsymtab_; ++i) {
+        if ((sym[i].st_info & ELF_STT_MASK) <= ELF_STT_FUNC
+            && sym[i].st_value != 0
+            && sym[i].st_shndx < ei.eh_->e_shnum
+            && (ei.sht_[sym[i].st_shndx].sh_flags & ELF_SHF_ALLOC)) {
+            syms.push_back(i);
+        }
+    }
+
+    elf_symindex hdr = {ELF_SYMINDEX_MAGIC, 0, 0, 0, 0};
+    std::vector<elf_symindex_entry> entries;
+    if (!syms.empty()) {
+        hdr.base = sym[syms.front()].st_value & ~uint64_t(0xFFF);
+    }
+    for (size_t j = 0; j != syms.size(); ++j) {
+        auto& s = sym[syms[j]];
+        uint64_t end = j + 1 == syms.size()
+            ? s.st_value + 0x1000 : sym[syms[j + 1]].st_value;
+        if (s.st_size != 0) {
+            end = std::min(end, s.st_value + s.st_size + 1);
+        }
+        if (end <= s.st_value) {
+            continue;
+        }
+        if (end - hdr.base > UINT32_MAX) {
+            fprintf(stderr, "%s: symbols span too many addresses to index\n",
+                    ei.filename_);
+            exit(1);
+        }
+        entries.push_back({uint32_t(s.st_value - hdr.base),
+                           uint32_t(end - hdr.base), syms[j]});
+    }
+    hdr.nentries = entries.size();
+    if (!entries.empty()) {
+        hdr.npages = (entries.back().end + 0xFFF) / 0x1000;
+    }
+
+    std::vector<uint32_t> buckets(hdr.npages);
+    size_t e = 0;
+    for (uint32_t p = 0; p != hdr.npages; ++p) {
+        while (e != entries.size() && entries[e].end <= p * 0x1000) {
+            ++e;
+        }
+        buckets[p] = e;
+    }
+
+    std::vector<char> index(sizeof(hdr) + buckets.size() * sizeof(uint32_t)
+                            + entries.size() * sizeof(elf_symindex_entry));
+    char* out = index.data();
+    memcpy(out, &hdr, sizeof(hdr));
+    out += sizeof(hdr);
+    memcpy(out, buckets.data(), buckets.size() * sizeof(uint32_t));
+    out += buckets.size() * sizeof(uint32_t);
+    memcpy(out, entries.data(), entries.size() * sizeof(elf_symindex_entry));
+    return index;
+}
+
 static unsigned rewrite_symtabref(elf_info& ei, const char* name,
                                   uint64_t& loadaddr, size_t strtab_off,
-                                  size_t size) {
+                                  size_t size, size_t index_off) {
     auto sym = ei.find_symbol(name);
     unsigned nfound = 0;
     while (sym) {
@@ -371,7 +474,8 @@ static unsigned rewrite_symtabref(elf_info& ei, const char* name,
                 reinterpret_cast<elf_symbol*>(loadaddr),
                 ei.nsymtab_,
                 reinterpret_cast<char*>(loadaddr + strtab_off),
-                size
+                size,
+                reinterpret_cast<elf_symindex*>(loadaddr + index_off)
             };
             if (memcmp(ei.data_ + stref_off, &xstref, sizeof(xstref)) != 0) {
                 memcpy(ei.data_ + stref_off, &xstref, sizeof(xstref));
@@ -426,9 +530,10 @@ int main(int argc, char** argv) {
 
     ei.filename_ = "<stdin>";
     int fd = STDIN_FILENO;
+    bool inplace = optind + 1 == argc && strcmp(argv[optind], "-") != 0;
     if (optind < argc && strcmp(argv[optind], "-") != 0) {
         ei.filename_ = argv[optind];
-        fd = open(ei.filename_, O_RDONLY);
+        fd = open(ei.filename_, inplace ? O_RDWR : O_RDONLY);
         if (fd == -1) {
             fprintf(stderr, "%s: %s\n", ei.filename_, strerror(errno));
             exit(1);
@@ -440,11 +545,16 @@ int main(int argc, char** argv) {
         struct stat s;
         int r = fstat(fd, &s);
         assert(r == 0);
-        ei.grow(S_ISREG(s.st_mode) ? (s.st_size + 32767) & ~32767 : 262144);
+        // edit a regular file in place if possible
+        if (!inplace
+            || !S_ISREG(s.st_mode)
+            || !ei.map(fd, s.st_size)) {
+            ei.grow(S_ISREG(s.st_mode) ? (s.st_size + 32767) & ~32767 : 262144);
+        }
         creatmode &= s.st_mode;
     }
 
-    while (true) {
+    while (ei.fd_ < 0) {
         if (ei.size_ == ei.capacity_) {
             ei.grow(ei.capacity_ * 2);
         }
@@ -497,21 +607,36 @@ int main(int argc, char** argv) {
     // figure out allocation range
     uint64_t first_offset = ei.sht_[symtabndx].sh_offset;
     uint64_t strtab_offset = ei.sht_[symtabndx + 1].sh_offset;
-    uint64_t last_offset = ei.sht_[symtabndx + 1].sh_offset
+    uint64_t strtab_end = ei.sht_[symtabndx + 1].sh_offset
         + ei.sht_[symtabndx + 1].sh_size;
 
+    // sort symbol table by address
+    ei.sort_symtab();
+
+    // place the address index after the string table, unless it's
+    // already there
+    std::vector<char> index = build_symindex(ei);
+    uint64_t index_offset = (strtab_end + 7) & ~uint64_t(7);
+    uint64_t last_offset = index_offset + index.size();
+    if (last_offset > ei.size_
+        || memcmp(ei.data_ + index_offset, index.data(), index.size()) != 0) {
+        ei.shift_sections(strtab_end, last_offset - strtab_end);
+        memcpy(ei.data_ + index_offset, index.data(), index.size());
+        if (verbose) {
+            fprintf(stderr, "%s: adding symbol index\n", ei.filename_);
+        }
+    }
+
     // find `lsymtab_name`
     if (!rewrite_symtabref(ei, lsymtab_name, loadaddr,
                            strtab_offset - first_offset,
-                           last_offset - first_offset)
+                           strtab_end - first_offset,
+                           index_offset - first_offset)
         && lsymtab_set) {
         fprintf(stderr, "%s: no `%s` symbol found\n", ei.filename_, lsymtab_name);
         exit(1);
     }
 
-    // sort symbol table by address
-    ei.sort_symtab();
-
     // mark symbol table as allocated
     if (loadaddr && !(ei.sht_[symtabndx].sh_flags & ELF_SHF_ALLOC)) {
         ei.sht_[symtabndx].sh_flags |= ELF_SHF_ALLOC;
@@ -572,8 +697,8 @@ int main(int argc, char** argv) {
         }
     }
 
-    // write output
-    if (!ei.changed_ && optind + 1 == argc && fd != STDIN_FILENO) {
+    // write output (a mapped file is already up to date)
+    if ((ei.fd_ >= 0 || !ei.changed_) && inplace) {
         exit(0);
     }
 
@@ -0,0 +1,280 @@
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <cinttypes>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+/* This program decodes WeensyOS kernel event traces.
+ * Typing 't' at the WeensyOS console writes the kernel's trace ring
+ * buffer to `log.txt` (see `trace_dump` in k-hardware.cc). This program
+ * finds the last such dump in a log file and prints a timeline of the
+ * recorded events followed by a latency histogram for each system call.
+ *
+ * System call latency is measured from the `syscall` event to the next
+ * return to user mode by the same process, so it includes time spent
+ * waiting to run again (for instance, after `sys_yield`).
+ */
+
+// Must match `trace_type` and `trace_event` in k-trace.hh.
+enum trace_type : uint8_t {
+    TRACE_SYSCALL = 1, TRACE_RETURN, TRACE_TIMER, TRACE_FAULT,
+    TRACE_EXCEPTION, TRACE_SCHEDULE, TRACE_PAGE_ALLOC, TRACE_PAGE_FREE
+};
+
+struct trace_event {
+    uint64_t tsc;
+    uint32_t seq;
+    uint8_t type;
+    uint8_t cpu;
+    int16_t pid;
+    uint64_t arg0;
+    uint64_t arg1;
+};
+static_assert(sizeof(trace_event) == 32, "trace_event has unexpected size");
+
+static const char header_prefix[] = "WEENSYOS TRACE v1 ";
+static const char trailer[] = "\nWEENSYOS TRACE END\n";
+
+static unsigned hz = 100;       // must match `HZ` in kernel.cc
+static double tsc_per_us = 0;   // 0 means “unknown; print cycles”
+
+
+static const char* syscall_name(uint64_t n) {
+    // Must match `SYSCALL_` constants in lib.hh.
+    static const char* const names[] = {
+        nullptr, "getpid", "yield", "panic", "page_alloc", "fork", "exit",
+        "sleep", "shm_create", "shm_attach", "pipe", "pipe_read",
+        "pipe_write", "getticks", "write", "getstats", "mmap",
+        "munmap", "log"
+    };
+    if (n < sizeof(names) / sizeof(names[0]) && names[n]) {
+        return names[n];
+    }
+    static char buf[32];
+    snprintf(buf, sizeof(buf), "syscall_%" PRIu64, n);
+    return buf;
+}
+
+static std::string format_time(uint64_t cycles) {
+    char buf[64];
+    if (tsc_per_us) {
+        snprintf(buf, sizeof(buf), "%.3fus", cycles / tsc_per_us);
+    } else {
+        snprintf(buf, sizeof(buf), "%" PRIu64 "cyc", cycles);
+    }
+    return buf;
+}
+
+
+// Read `filename` and return the events in its last trace dump.
+static std::vector<trace_event> read_trace(const char* filename) {
+    FILE* f = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "rb");
+    if (!f) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    std::string data;
+    char buf[BUFSIZ];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        data.append(buf, n);
+    }
+    if (f != stdin) {
+        fclose(f);
+    }
+
+    // Find the last complete dump.
+    size_t pos = data.size();
+    while (true) {
+        pos = data.rfind(header_prefix, pos);
+        if (pos == std::string::npos) {
+            fprintf(stderr, "%s: no trace found (type 't' in WeensyOS to dump one)\n", filename);
+            exit(1);
+        }
+        uint64_t first, count;
+        size_t size;
+        size_t eol = data.find('\n', pos);
+        if (eol != std::string::npos
+            && sscanf(data.c_str() + pos + sizeof(header_prefix) - 1,
+                      "first=%" SCNu64 " count=%" SCNu64 " size=%zu",
+                      &first, &count, &size) == 3
+            && size == sizeof(trace_event)
+            && eol + 1 + count * size + sizeof(trailer) - 1 <= data.size()
+            && data.compare(eol + 1 + count * size, sizeof(trailer) - 1,
+                            trailer) == 0) {
+            std::vector<trace_event> events;
+            for (uint64_t i = 0; i != count; ++i) {
+                trace_event e;
+                memcpy(&e, data.data() + eol + 1 + i * size, size);
+                // Drop records overwritten during the dump.
+                if (e.seq == uint32_t(first + i)) {
+                    events.push_back(e);
+                }
+            }
+            if (events.size() != count) {
+                fprintf(stderr, "%s: dropped %zu overwritten events\n",
+                        filename, size_t(count - events.size()));
+            }
+            return events;
+        }
+        if (pos == 0) {
+            pos = std::string::npos;
+        } else {
+            --pos;
+        }
+    }
+}
+
+
+// Estimate the TSC rate from CPU 0's timer events, which occur `hz`
+// times a second.
+static void calibrate(const std::vector<trace_event>& events) {
+    const trace_event* a = nullptr;
+    const trace_event* b = nullptr;
+    for (auto& e : events) {
+        if (e.type == TRACE_TIMER && e.cpu == 0) {
+            if (!a) {
+                a = &e;
+            }
+            b = &e;
+        }
+    }
+    if (a && b && b->arg0 > a->arg0 && b->tsc > a->tsc) {
+        double ticks = b->arg0 - a->arg0;
+        tsc_per_us = (b->tsc - a->tsc) / ticks * hz / 1e6;
+    }
+}
+
+
+static void print_timeline(const std::vector<trace_event>& events) {
+    uint64_t t0 = events.empty() ? 0 : events.front().tsc;
+    for (auto& e : events) {
+        printf("%14s  cpu%u  pid %2d  ",
+               format_time(e.tsc - t0).c_str(), e.cpu, e.pid);
+        switch (e.type) {
+        case TRACE_SYSCALL:
+            printf("syscall %s(%#" PRIx64 ")\n", syscall_name(e.arg0), e.arg1);
+            break;
+        case TRACE_RETURN:
+            printf("return to user at %#" PRIx64 "\n", e.arg0);
+            break;
+        case TRACE_TIMER:
+            printf("timer (ticks %" PRIu64 ")\n", e.arg0);
+            break;
+        case TRACE_FAULT:
+            printf("page fault at %#" PRIx64 " (%s %s%s)\n", e.arg0,
+                   e.arg1 & 2 ? "write" : "read",
+                   e.arg1 & 1 ? "protection" : "missing",
+                   e.arg1 & 4 ? ", user" : ", kernel");
+            break;
+        case TRACE_EXCEPTION:
+            printf("exception %" PRIu64 " at %#" PRIx64 "\n", e.arg0, e.arg1);
+            break;
+        case TRACE_SCHEDULE:
+            printf("schedule pid %" PRIu64 " from cpu%" PRIu64 "\n",
+                   e.arg0, e.arg1);
+            break;
+        case TRACE_PAGE_ALLOC:
+            printf("alloc page %#" PRIx64 "\n", e.arg0);
+            break;
+        case TRACE_PAGE_FREE:
+            printf("free page %#" PRIx64 "\n", e.arg0);
+            break;
+        default:
+            printf("unknown event %u (%#" PRIx64 ", %#" PRIx64 ")\n",
+                   e.type, e.arg0, e.arg1);
+            break;
+        }
+    }
+}
+
+
+static void print_latencies(const std::vector<trace_event>& events) {
+    // Match each syscall with its process's next return to user mode.
+    std::map<int, const trace_event*> pending;
+    std::map<uint64_t, std::vector<uint64_t>> latencies;
+    for (auto& e : events) {
+        if (e.type == TRACE_SYSCALL) {
+            pending[e.pid] = &e;
+        } else if (e.type == TRACE_RETURN) {
+            auto it = pending.find(e.pid);
+            if (it != pending.end()) {
+                latencies[it->second->arg0].push_back(e.tsc - it->second->tsc);
+                pending.erase(it);
+            }
+        }
+    }
+
+    for (auto& [num, lat] : latencies) {
+        std::sort(lat.begin(), lat.end());
+        printf("\n%s: %zu calls, min %s, median %s, max %s\n",
+               syscall_name(num), lat.size(),
+               format_time(lat.front()).c_str(),
+               format_time(lat[lat.size() / 2]).c_str(),
+               format_time(lat.back()).c_str());
+
+        // Power-of-two buckets in cycles.
+        std::map<int, size_t> buckets;
+        size_t maxcount = 0;
+        for (auto l : lat) {
+            int b = l ? 63 - __builtin_clzll(l) : 0;
+            maxcount = std::max(maxcount, ++buckets[b]);
+        }
+        for (auto& [b, count] : buckets) {
+            std::string range = "<" + format_time(uint64_t(2) << b);
+            int width = int((count * 50 + maxcount - 1) / maxcount);
+            printf("  %14s %7zu |%s\n", range.c_str(), count,
+                   std::string(width, '#').c_str());
+        }
+    }
+}
+
+
+static void usage() {
+    fprintf(stderr, "Usage: tracedecode [-s] [-z HZ] [LOGFILE]\n");
+    fprintf(stderr, "  -s     print latency histograms only\n");
+    fprintf(stderr, "  -z HZ  kernel timer rate (default 100)\n");
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    bool summary_only = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "sz:")) != -1) {
+        switch (opt) {
+        case 's':
+            summary_only = true;
+            break;
+        case 'z':
+            hz = strtoul(optarg, nullptr, 0);
+            if (hz == 0) {
+                usage();
+            }
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind + 1 < argc) {
+        usage();
+    }
+    const char* filename = optind < argc ? argv[optind] : "log.txt";
+
+    std::vector<trace_event> events = read_trace(filename);
+    // CPUs record into the ring concurrently, so sort by timestamp.
+    std::stable_sort(events.begin(), events.end(),
+                     [] (const trace_event& a, const trace_event& b) {
+                         return a.tsc < b.tsc;
+                     });
+    calibrate(events);
+
+    if (!summary_only) {
+        print_timeline(events);
+    }
+    print_latencies(events);
+}
@@ -70,12 +70,34 @@ struct elf_symbol {
     uint64_t st_size;
 };
 
+// address index for a sorted debug symbol table (not part of ELF)
+// Built by `mkchickadeesymtab` and loaded right after the string table.
+// Entry `i` names symbol `sym` for addresses [base + start, base + end);
+// entries are sorted and do not overlap. The header is followed by
+// `uint32_t bucket[npages]`, where `bucket[p]` is the first entry ending
+// after `base + p * 4096`, then by the entries. So a lookup only scans
+// entries that overlap one page.
+struct elf_symindex {
+    uint32_t magic;             // must equal ELF_SYMINDEX_MAGIC
+    uint32_t nentries;
+    uint64_t base;              // page-aligned
+    uint32_t npages;
+    uint32_t reserved;
+};
+struct elf_symindex_entry {
+    uint32_t start;
+    uint32_t end;
+    uint32_t sym;
+};
+#define ELF_SYMINDEX_MAGIC      0x58444953U  // "SIDX"
+
 // in-memory reference to debug symbol table + string table
 struct elf_symtabref {
     elf_symbol* sym;
     size_t nsym;
     char* strtab;
-    size_t size;
+    size_t size;                // of symbol table + string table
+    elf_symindex* index;        // address index, or `nullptr`
 };
 
 // Values for elf_header::e_type
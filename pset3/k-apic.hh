@@ -28,6 +28,7 @@ struct lapicstate {
     };
 
     enum ipi_type_t {
+        ipi_fixed = 0,
         ipi_init = 0x500,
         ipi_startup = 0x600
     };
@@ -4,6 +4,7 @@
 #include "k-apic.hh"
 #include "k-pci.hh"
 #include "k-vmiter.hh"
+#include "k-trace.hh"
 #include "obj/k-foreachimage.h"
 #include <atomic>
 
@@ -21,8 +22,12 @@ pcistate pcistate::state;
 static void init_kernel_memory();
 static void init_interrupts();
 static void init_constructors();
-static void init_cpu_hardware();
+static void init_cpu_hardware(cpustate* c);
 static void stash_kernel_data(bool restore);
+static void delay();
+static void flush_tlb_all_pcids();
+extern std::atomic<bool> panicking;
+static bool has_invpcid;
 
 void init_hardware() {
     // initialize kernel virtual memory structures
@@ -38,8 +43,17 @@ void init_hardware() {
     // (NB none of these constructors may allocate memory)
     init_constructors();
 
+    // initialize per-CPU state for all CPUs; the boot CPU must be CPU 0
+    extern uint8_t _kernel_end[];
+    assert((uintptr_t) _kernel_end <= kptr2pa(cpu_state(MAXCPU - 1)));
+    assert(lapicstate::get().id() == 0);
+    for (int i = 0; i != MAXCPU; ++i) {
+        cpu_state(i)->init(i);
+    }
+    ncpu = 1;
+
     // initialize this CPU
-    init_cpu_hardware();
+    init_cpu_hardware(this_cpu());
 }
 
 
@@ -190,30 +204,50 @@ void init_constructors() {
 }
 
 
-static x86_64_taskstate taskstate;
+// cpustate::init(index)
+//    Initialize the state for CPU `index`. The boot CPU calls this for every
+//    CPU before starting the others, so run queues are valid everywhere.
+
+std::atomic<int> ncpu;
+
+static_assert(sizeof(cpustate) <= PAGESIZE / 4,
+              "cpustate must leave room for the kernel stack");
+static_assert(offsetof(cpustate, current_) == 0,
+              "k-exception.S assumes cpustate::current_ is at offset 0");
+static_assert(offsetof(cpustate, stack_top_) == 8,
+              "k-exception.S assumes cpustate::stack_top_ is at offset 8");
 
-void init_cpu_hardware() {
+void cpustate::init(int index) {
+    new (this) cpustate;
+    current_ = nullptr;
+    stack_top_ = KERNEL_STACK_TOP - index * PAGESIZE;
+    index_ = index;
+    runq_head_ = runq_tail_ = nullptr;
+}
+
+
+void init_cpu_hardware(cpustate* c) {
     // initialize per-CPU segments
-    gdt_segments[0] = 0;
-    set_app_segment(&gdt_segments[SEGSEL_KERN_CODE >> 3],
+    c->gdt_segments_[0] = 0;
+    set_app_segment(&c->gdt_segments_[SEGSEL_KERN_CODE >> 3],
                     X86SEG_X | X86SEG_L, 0);
-    set_app_segment(&gdt_segments[SEGSEL_KERN_DATA >> 3],
+    set_app_segment(&c->gdt_segments_[SEGSEL_KERN_DATA >> 3],
                     X86SEG_W, 0);
-    set_app_segment(&gdt_segments[SEGSEL_APP_CODE >> 3],
+    set_app_segment(&c->gdt_segments_[SEGSEL_APP_CODE >> 3],
                     X86SEG_X | X86SEG_L, 3);
-    set_app_segment(&gdt_segments[SEGSEL_APP_DATA >> 3],
+    set_app_segment(&c->gdt_segments_[SEGSEL_APP_DATA >> 3],
                     X86SEG_W, 3);
-    set_sys_segment(&gdt_segments[SEGSEL_TASKSTATE >> 3],
-                    (uintptr_t) &taskstate, sizeof(taskstate),
+    set_sys_segment(&c->gdt_segments_[SEGSEL_TASKSTATE >> 3],
+                    (uintptr_t) &c->taskstate_, sizeof(c->taskstate_),
                     X86SEG_TSS, 0);
 
     // taskstate lets the kernel receive interrupts
-    memset(&taskstate, 0, sizeof(taskstate));
-    taskstate.ts_rsp[0] = KERNEL_STACK_TOP;
+    memset(&c->taskstate_, 0, sizeof(c->taskstate_));
+    c->taskstate_.ts_rsp[0] = c->stack_top_;
 
     x86_64_pseudodescriptor gdt, idt;
-    gdt.limit = sizeof(gdt_segments) - 1;
-    gdt.base = (uint64_t) gdt_segments;
+    gdt.limit = sizeof(c->gdt_segments_) - 1;
+    gdt.base = (uint64_t) c->gdt_segments_;
     idt.limit = sizeof(interrupt_descriptors) - 1;
     idt.base = (uint64_t) interrupt_descriptors;
 
@@ -235,6 +269,23 @@ void init_cpu_hardware() {
     cr0 |= CR0_PE | CR0_PG | CR0_WP | CR0_AM | CR0_MP | CR0_NE;
     wrcr0(cr0);
 
+    // use process-context identifiers if the CPU supports them
+    // (The kernel page table must be loaded with PCID 0 to set CR4_PCIDE.)
+    unsigned kpcid = pagetable_pcid(kernel_pagetable);
+    if (cpuid(1).ecx & (1 << 17)) {
+        wrcr3(kptr2pa(kernel_pagetable));
+        wrcr4(rdcr4() | CR4_PCIDE);
+        kernel_cr3 = kptr2pa(kernel_pagetable) | kpcid | CR3_NOFLUSH;
+        wrcr3(kernel_cr3);
+        has_invpcid = cpuid(7, 0).ebx & (1 << 10);
+        // a soft reboot may leave entries tagged with old PCIDs
+        flush_tlb_all_pcids();
+    } else {
+        kernel_cr3 = kptr2pa(kernel_pagetable);
+    }
+    // the kernel runs on `kernel_pagetable`
+    c->ran_pcids_[kpcid / 64] = uint64_t(1) << (kpcid % 64);
+
 
     // set up syscall/sysret
     wrmsr(MSR_IA32_STAR, (uintptr_t(SEGSEL_KERN_CODE) << 32)
@@ -242,6 +293,8 @@ void init_cpu_hardware() {
     wrmsr(MSR_IA32_LSTAR, reinterpret_cast<uint64_t>(syscall_entry));
     wrmsr(MSR_IA32_FMASK, EFLAGS_TF | EFLAGS_DF | EFLAGS_IF
           | EFLAGS_IOPL_MASK | EFLAGS_AC | EFLAGS_NT);
+    // `syscall_entry` uses `swapgs` to find this CPU's `cpustate`
+    wrmsr(MSR_IA32_KERNEL_GS_BASE, kptr2pa(c));
 
 
     // initialize local APIC (interrupt controller)
@@ -268,6 +321,164 @@ void init_cpu_hardware() {
 }
 
 
+// boot_aps
+//    Start the application processors with the INIT-SIPI-SIPI sequence.
+//    The startup IPI names a page below 1MiB where each processor starts
+//    in real mode; that is `ap_entry` in k-exception.S.
+
+extern uint8_t ap_entry[];
+
+static void udelay(unsigned usec) {
+    // Each `delay()` takes about 4 ISA bus cycles (roughly a microsecond).
+    for (unsigned i = 0; i != usec; ++i) {
+        delay();
+    }
+}
+
+void boot_aps() {
+    uintptr_t entry_pa = kptr2pa(ap_entry);
+    assert(entry_pa % PAGESIZE == 0 && entry_pa < 0x100000);
+
+    auto& lapic = lapicstate::get();
+    lapic.ipi_others(lapic.ipi_init);
+    udelay(10000);
+    for (int i = 0; i != 2; ++i) {
+        lapic.ipi_others(lapic.ipi_startup, entry_pa / PAGESIZE);
+        udelay(200);
+        while (lapic.ipi_pending()) {
+            pause();
+        }
+    }
+
+    // We don't know how many CPUs exist, so wait until they stop arriving.
+    int n = ncpu;
+    for (int quiet = 0; quiet < 20000 && n < MAXCPU; ++quiet) {
+        delay();
+        if (ncpu != n) {
+            n = ncpu;
+            quiet = 0;
+        }
+    }
+    log_printf("%d CPU%s\n", n, n == 1 ? "" : "s");
+}
+
+
+// ap_start
+//    Called by `ap_entry` in k-exception.S on each application processor,
+//    running on that processor's kernel stack.
+
+[[noreturn]] void ap_start();
+
+void ap_start() {
+    init_cpu_hardware(this_cpu());
+    ++ncpu;
+    kernel_ap_start();
+}
+
+
+// process_cr3(p), invalidate_tlb(pt)
+//    With PCIDs, loading `%cr3` no longer flushes the TLB, so page table
+//    changes must be flushed explicitly. Each page table is an address
+//    space with its own PCID (`pagetable_pcid`), and is flushed only on
+//    the CPUs that have run it (`cpustate::ran_pcids_`).
+//
+//    `invalidate_tlb(pt)` flushes `pt`'s PCID on this CPU and marks it in
+//    the other CPUs' `stale_pcids_`; `process_cr3` flushes a stale PCID
+//    before loading it. A CPU already running user code in `pt` would
+//    keep its stale entries until its next kernel entry, so
+//    `invalidate_tlb` also waits for it, interrupting it with `IRQ_TLB`.
+//    `process_cr3` sets `user_pcid_` and `in_user_` before it checks
+//    `stale_pcids_`, and `in_user_` is cleared on kernel entry, so either
+//    the returning CPU sees the mark or `invalidate_tlb` sees it heading
+//    for user mode and waits.
+
+uint64_t kernel_cr3;
+
+static void flush_tlb_all_pcids() {
+    // changing CR4_PGE flushes every TLB entry for every PCID
+    uint64_t cr4 = rdcr4();
+    wrcr4(cr4 ^ CR4_PGE);
+    wrcr4(cr4);
+}
+
+// flush_pcid(c, pcid)
+//    Flush PCID `pcid` from this CPU's TLB. `c` is `this_cpu()`.
+
+static void flush_pcid(cpustate* c, unsigned pcid) {
+    c->stale_pcids_[pcid / 64] &= ~(uint64_t(1) << (pcid % 64));
+    if (!(kernel_cr3 & CR3_NOFLUSH)) {
+        // Without PCIDs, entering the kernel flushed all but the kernel
+        // page table, which is loaded now.
+        if (pcid == pagetable_pcid(kernel_pagetable)) {
+            tlbflush();
+        }
+    } else if (has_invpcid) {
+        invpcid(INVPCID_SINGLE, pcid);
+    } else {
+        flush_tlb_all_pcids();
+        for (int w = 0; w != NPCIDWORDS; ++w) {
+            c->stale_pcids_[w] = 0;
+        }
+    }
+}
+
+void invalidate_tlb(x86_64_pagetable* pt) {
+    unsigned pcid = pagetable_pcid(pt);
+    unsigned w = pcid / 64;
+    uint64_t bit = uint64_t(1) << (pcid % 64);
+    cpustate* self = this_cpu();
+    // Order the caller's page table writes before reading `ran_pcids_`:
+    // a CPU that sets its bit later also sees the new mappings.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    flush_pcid(self, pcid);
+
+    bool sent = false;
+    for (int i = 0; i != ncpu; ++i) {
+        cpustate* c = cpu_state(i);
+        if (c == self || !(c->ran_pcids_[w] & bit)) {
+            continue;
+        }
+        c->stale_pcids_[w] |= bit;
+        while (c->in_user_
+               && c->user_pcid_ == pcid
+               && (c->stale_pcids_[w] & bit)) {
+            if (!sent) {
+                lapicstate::get().ipi_others(lapicstate::ipi_fixed,
+                                             INT_IRQ + IRQ_TLB);
+                sent = true;
+            }
+            pause();
+        }
+    }
+}
+
+uint64_t process_cr3(proc* p) {
+    // Every return to user mode passes through here.
+    trace(TRACE_RETURN, p->regs.reg_rip);
+    unsigned pcid = pagetable_pcid(p->pagetable);
+    unsigned w = pcid / 64;
+    uint64_t bit = uint64_t(1) << (pcid % 64);
+    cpustate* c = this_cpu();
+    if (!(c->ran_pcids_[w].load(std::memory_order_relaxed) & bit)) {
+        c->ran_pcids_[w] |= bit;
+    }
+    c->user_pcid_.store(pcid, std::memory_order_relaxed);
+    c->in_user_.store(true, std::memory_order_relaxed);
+    // `run` just set `c->current_`, and we just set `ran_pcids_`,
+    // `user_pcid_`, and `in_user_`. Order those stores before this load:
+    // `reclaim_pages` and `invalidate_tlb` must see them, or we must see
+    // their changes.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (c->stale_pcids_[w].load(std::memory_order_relaxed) & bit) {
+        flush_pcid(c, pcid);
+    }
+    if (!(kernel_cr3 & CR3_NOFLUSH)) {
+        return kptr2pa(p->pagetable);
+    }
+    return kptr2pa(p->pagetable) | pcid | CR3_NOFLUSH;
+}
+
+
 // init_timer(rate)
 //    Set the timer interrupt to fire `rate` times a second. Disables the
 //    timer interrupt if `rate <= 0`.
@@ -286,11 +497,7 @@ void init_timer(int rate) {
 //    Allocate and return a new, empty page table.
 
 x86_64_pagetable* kalloc_pagetable() {
-    x86_64_pagetable* pt = reinterpret_cast<x86_64_pagetable*>(kalloc(PAGESIZE));
-    if (pt) {
-        memset(&pt->entry[0], 0, sizeof(x86_64_pagetable));
-    }
-    return pt;
+    return reinterpret_cast<x86_64_pagetable*>(kzalloc(PAGESIZE));
 }
 
 
@@ -348,7 +555,7 @@ bool allocatable_physical_address(uintptr_t pa) {
     return !reserved_physical_address(pa)
         && (pa < KERNEL_START_ADDR
             || pa >= round_up((uintptr_t) _kernel_end, PAGESIZE))
-        && (pa < KERNEL_STACK_TOP - PAGESIZE
+        && (pa < KERNEL_STACK_TOP - MAXCPU * PAGESIZE
             || pa >= KERNEL_STACK_TOP)
         && pa < MEMSIZE_PHYSICAL;
 }
@@ -633,39 +840,74 @@ void log_printf(const char* format, ...) {
 }
 
 
+// trace_dump
+//    Write the trace ring buffer to `log.txt`: a text header line, the
+//    raw `trace_event` records from oldest to newest, and an end line.
+//    `build/tracedecode.cc` parses this format. Other CPUs may keep
+//    recording during the dump; the decoder drops records whose `seq`
+//    shows they were overwritten.
+
+trace_event trace_ring[TRACE_NEVENTS];
+std::atomic<uint64_t> trace_head;
+
+void trace_dump() {
+    uint64_t head = trace_head;
+    uint64_t first = head > TRACE_NEVENTS ? head - TRACE_NEVENTS : 0;
+    log_printf("\nWEENSYOS TRACE v1 first=%lu count=%lu size=%zu\n",
+               first, head - first, sizeof(trace_event));
+    for (uint64_t seq = first; seq != head; ++seq) {
+        auto bytes = reinterpret_cast<const unsigned char*>(
+            &trace_ring[seq % TRACE_NEVENTS]
+        );
+        for (size_t i = 0; i != sizeof(trace_event); ++i) {
+            parallel_port_putc(bytes[i]);
+        }
+    }
+    log_printf("\nWEENSYOS TRACE END\n");
+}
+
+
 // symtab: reference to kernel symbol table; useful for debugging.
 // The `mkchickadeesymtab` program fills this structure in.
 #define SYMTAB_ADDR 0x1000000
 elf_symtabref symtab = {
-    reinterpret_cast<elf_symbol*>(SYMTAB_ADDR), 0, nullptr, 0
+    reinterpret_cast<elf_symbol*>(SYMTAB_ADDR), 0, nullptr, 0, nullptr
 };
 
 // lookup_symbol(addr, name, start)
 //    Use the debugging symbol table to look up `addr`. Return the
 //    corresponding symbol name (usually a function name) in `*name`
 //    and the first address in that symbol in `*start`.
+//
+//    `mkchickadeesymtab` builds an address index with one bucket per
+//    page (see `elf_symindex`), so a lookup only scans the few symbols
+//    that overlap `addr`'s page. This keeps the profiler cheap.
 
 __no_asan
 bool lookup_symbol(uintptr_t addr, const char** name, uintptr_t* start) {
     extern elf_symtabref symtab;
-    if (!kernel_pagetable[2].entry[SYMTAB_ADDR / 0x200000]) {
-        kernel_pagetable[2].entry[SYMTAB_ADDR / 0x200000] =
-            SYMTAB_ADDR | PTE_P | PTE_W | PTE_PS;
-    }
-
-    size_t l = 0;
-    size_t r = symtab.nsym;
-    while (l < r) {
-        size_t m = l + ((r - l) >> 1);
-        auto& sym = symtab.sym[m];
-        if (sym.st_value <= addr
-            && (m + 1 == symtab.nsym
-                ? addr < sym.st_value + 0x1000
-                : addr < (&sym)[1].st_value)
-            && (sym.st_size == 0 || addr <= sym.st_value + sym.st_size)) {
-            if (!sym.st_value) {
-                return false;
-            }
+    // the symbol table is kernel-only, so map it with one large page
+    vmiter it(kernel_pagetable, SYMTAB_ADDR);
+    if (!it.present()) {
+        it.map_large(SYMTAB_ADDR, PTE_P | PTE_W);
+    }
+
+    const elf_symindex* idx = symtab.index;
+    if (!idx || idx->magic != ELF_SYMINDEX_MAGIC || addr < idx->base) {
+        return false;
+    }
+    uintptr_t off = addr - idx->base;
+    if (off / PAGESIZE >= idx->npages) {
+        return false;
+    }
+    auto bucket = reinterpret_cast<const uint32_t*>(idx + 1);
+    auto entry = reinterpret_cast<const elf_symindex_entry*>
+        (bucket + idx->npages);
+    for (uint32_t i = bucket[off / PAGESIZE];
+         i != idx->nentries && entry[i].start <= off;
+         ++i) {
+        if (off < entry[i].end) {
+            auto& sym = symtab.sym[entry[i].sym];
             if (name) {
                 *name = symtab.strtab + sym.st_name;
             }
@@ -673,10 +915,6 @@ bool lookup_symbol(uintptr_t addr, const char** name, uintptr_t* start) {
                 *start = sym.st_value;
             }
             return true;
-        } else if (sym.st_value < addr) {
-            l = m + 1;
-        } else {
-            r = m;
         }
     }
     return false;
@@ -818,7 +1056,7 @@ __always_inline const regstate& backtrace_current_regs() {
 }
 
 __always_inline x86_64_pagetable* backtrace_current_pagetable() {
-    return pa2kptr<x86_64_pagetable*>(rdcr3());
+    return pa2kptr<x86_64_pagetable*>(rdcr3() & PTE_PAMASK);
 }
 
 
@@ -836,14 +1074,24 @@ void error_vprintf(int cpos, int color, const char* format, va_list val) {
 // check_keyboard
 //    Check for the user typing a control key. 'a', 'f', and 'e' cause a soft
 //    reboot where the kernel runs the allocator programs, "fork", or
-//    "exit", respectively. Control-C or 'q' exit the virtual machine.
+//    "exit", respectively. 't' dumps the event trace to `log.txt`,
+//    'p' starts or stops the sampling profiler (see k-profile.cc), and
+//    'l' dumps lock statistics (see k-lock.hh).
+//    Control-C or 'q' exit the virtual machine.
 //    Returns key typed or -1 for no key.
 
 int check_keyboard() {
+    // Only CPU 0 reads the keyboard, unless the kernel is panicking.
+    if (this_cpu()->index_ != 0 && !panicking) {
+        return -1;
+    }
     int c = keyboard_readc();
     if (c == 'a' || c == 'f' || c == 'e') {
-        // Turn off the timer interrupt.
+        // Turn off the timer interrupt and stop the other CPUs.
         init_timer(-1);
+        if (ncpu > 1) {
+            lapicstate::get().ipi_others(lapicstate::ipi_init);
+        }
         // Install a temporary page table to carry us through the
         // process of reinitializing memory. This replicates work the
         // bootloader does.
@@ -877,6 +1125,12 @@ int check_keyboard() {
         // restart kernel
         asm volatile("movl $0x2BADB002, %%eax; jmp kernel_entry"
                      : : "b" (multiboot_info) : "memory");
+    } else if (c == 't') {
+        trace_dump();
+    } else if (c == 'p') {
+        profile_toggle();
+    } else if (c == 'l') {
+        lockstats_dump();
     } else if (c == 0x03 || c == 'q') {
         poweroff();
     }
@@ -977,6 +1231,7 @@ static void vpanic(const regstate& regs, x86_64_pagetable* pt,
         pr.printf("PANIC: ");
     }
     pr.vprintf(format, val);
+    pr.flush();
     if (CCOL(pr.cell_ - console)) {
         pr.printf("\n");
     }
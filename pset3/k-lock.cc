@@ -0,0 +1,76 @@
+#include "kernel.hh"
+
+// k-lock.cc
+//
+//    Lock statistics (see `k-lock.hh`).
+
+#if WEENSYOS_LOCKSTATS
+static lock_stats lockstats_table[LOCKSTATS_MAX];
+static std::atomic<unsigned> lockstats_count;   // entries claimed
+
+void lockstats_acquired(uint8_t& id, const void* lock, unsigned long spins) {
+    if (id == 0) {
+        // first acquisition: claim an entry (only the holder writes `id`)
+        unsigned i = lockstats_count.load(std::memory_order_relaxed);
+        do {
+            if (i == LOCKSTATS_MAX) {
+                id = LOCKSTATS_UNTRACKED;
+                return;
+            }
+        } while (!lockstats_count.compare_exchange_weak(i, i + 1));
+        lockstats_table[i].lock_ = lock;
+        id = i + 1;
+    } else if (id == LOCKSTATS_UNTRACKED) {
+        return;
+    }
+    lock_stats& st = lockstats_table[id - 1];
+    ++st.nacquires;
+    if (spins != 0) {
+        ++st.ncontended;
+        st.nspins += spins;
+    }
+    st.acquire_tsc = rdtsc();
+}
+
+void lockstats_released(uint8_t id) {
+    if (id == 0 || id == LOCKSTATS_UNTRACKED) {
+        return;
+    }
+    lock_stats& st = lockstats_table[id - 1];
+    uint64_t hold = rdtsc() - st.acquire_tsc;
+    if (hold > st.max_hold) {
+        st.max_hold = hold;
+    }
+}
+
+void lockstats_dump() {
+    log_printf("\nWEENSYOS LOCKSTATS\n"
+               "%10s %10s %12s %12s  lock\n",
+               "acquires", "contended", "spins", "max hold");
+    unsigned n = lockstats_count.load(std::memory_order_acquire);
+    for (lock_stats* st = lockstats_table; st != lockstats_table + n; ++st) {
+        // counters are a snapshot; their holders may be updating them
+        uintptr_t addr = reinterpret_cast<uintptr_t>(st->lock_);
+        log_printf("%10lu %10lu %12lu %12lu  %p", st->nacquires,
+                   st->ncontended, st->nspins,
+                   (unsigned long) st->max_hold, st->lock_);
+        const char* name;
+        uintptr_t start;
+        if (lookup_symbol(addr, &name, &start)) {
+            log_printf(addr == start ? "  <%s>\n" : "  <%s+%#lx>\n",
+                       name, addr - start);
+        } else {
+            log_printf("\n");
+        }
+    }
+    if (n == LOCKSTATS_MAX) {
+        log_printf("(table full: later locks are not counted)\n");
+    }
+    log_printf("WEENSYOS LOCKSTATS END\n");
+    console_printf(CPOS(24, 0), 0x0E00, "Lock statistics written to log.txt\n");
+}
+#else
+void lockstats_dump() {
+    console_printf(CPOS(24, 0), 0x0E00, "No lock statistics (build with LOCKSTATS=1)\n");
+}
+#endif
@@ -0,0 +1,301 @@
+#ifndef WEENSYOS_K_LOCK_HH
+#define WEENSYOS_K_LOCK_HH
+#include "x86-64.h"
+#include "types.h"
+#include <atomic>
+
+// k-lock.hh
+//
+//    Spinlocks protecting kernel data shared between CPUs.
+//
+//    `spinlock` is a ticket lock: CPUs acquire it in arrival order, so
+//    no CPU starves. `mcs_lock` is a queue lock for heavily contended
+//    data: each waiter spins on its own `mcs_lock::node`, not on the
+//    shared lock word.
+//
+//    The WeensyOS kernel runs with interrupts disabled, so `lock()` never
+//    saves or restores the interrupt flag. Code that may run with
+//    interrupts enabled and shares data with an interrupt handler should
+//    use `lock_irqsave()` and `unlock_irqrestore()` instead.
+//
+//    `make LOCKSTATS=1` builds a kernel whose locks count acquisitions,
+//    contended acquisitions, spin iterations, and the longest hold time
+//    (in TSC cycles). The counters live in a fixed table, not in the
+//    lock: a lock claims an entry on its first acquisition and keeps it
+//    even if freed, and locks first acquired after the table fills are
+//    not counted. `lockstats_dump()` (the 'l' key) writes the table to
+//    `log.txt`.
+
+
+// irqstate
+//    Saved interrupt flag.
+
+struct irqstate {
+    bool enabled_;
+
+    // Disable interrupts and return the previous interrupt state.
+    static irqstate disable() {
+        irqstate irqs{!is_cli()};
+        cli();
+        return irqs;
+    }
+    // Restore the saved interrupt state.
+    void restore() const {
+        if (enabled_) {
+            sti();
+        }
+    }
+};
+
+
+#if WEENSYOS_LOCKSTATS
+// lock_stats
+//    Contention counters for one lock, in `lockstats_table`. Only the lock
+//    holder writes them.
+
+struct lock_stats {
+    unsigned long nacquires = 0;
+    unsigned long ncontended = 0;       // acquisitions that had to wait
+    unsigned long nspins = 0;           // spin iterations while waiting
+    uint64_t max_hold = 0;              // longest hold time (TSC cycles)
+    uint64_t acquire_tsc = 0;
+    const void* lock_ = nullptr;        // lock these stats belong to
+};
+
+#define LOCKSTATS_MAX           64      // number of `lockstats_table` entries
+#define LOCKSTATS_UNTRACKED     0xFF    // `stats_id_` of a lock with no entry
+
+// lockstats_acquired(id, lock, spins), lockstats_released(id)
+//    Update the statistics of the lock with `stats_id_` `id`. The first
+//    acquisition assigns `id`. These are out of line so that statistics
+//    cost one call per `lock()` and `unlock()`, not inlined code.
+void lockstats_acquired(uint8_t& id, const void* lock, unsigned long spins);
+void lockstats_released(uint8_t id);
+#endif
+
+// lockstats_dump()
+//    Write the statistics of every lock acquired so far to `log.txt`,
+//    naming kernel-global locks with `lookup_symbol`.
+void lockstats_dump();
+
+
+struct spinlock {
+    std::atomic<uint16_t> now_ = 0;     // ticket currently served
+    std::atomic<uint16_t> next_ = 0;    // next ticket to hand out
+#if WEENSYOS_LOCKSTATS
+    uint8_t stats_id_ = 0;              // `lockstats_table` index + 1, or 0
+#endif
+
+
+    // Acquire the lock, spinning until it is available.
+    void lock() {
+        uint16_t t = next_.fetch_add(1, std::memory_order_relaxed);
+        unsigned long spins = 0;
+        while (now_.load(std::memory_order_acquire) != t) {
+            pause();
+            ++spins;
+        }
+        note_acquired(spins);
+    }
+
+    // Acquire the lock if it is available. Returns true on success.
+    bool try_lock() {
+        // The lock is free iff `next_ == now_`; `now_` cannot advance
+        // while the lock is free.
+        uint16_t t = now_.load(std::memory_order_relaxed);
+        if (!next_.compare_exchange_strong(t, t + 1,
+                                           std::memory_order_acquire,
+                                           std::memory_order_relaxed)) {
+            return false;
+        }
+        note_acquired(0);
+        return true;
+    }
+
+    // Release the lock.
+    void unlock() {
+#if WEENSYOS_LOCKSTATS
+        lockstats_released(stats_id_);
+#endif
+        now_.store(now_.load(std::memory_order_relaxed) + 1,
+                   std::memory_order_release);
+    }
+
+    // Return true iff the lock is currently held (by any CPU).
+    bool is_locked() const {
+        return now_.load(std::memory_order_relaxed)
+            != next_.load(std::memory_order_relaxed);
+    }
+
+    // Disable interrupts, then acquire the lock. Returns the interrupt
+    // state to pass to `unlock_irqrestore`.
+    irqstate lock_irqsave() {
+        irqstate irqs = irqstate::disable();
+        lock();
+        return irqs;
+    }
+
+    // Release the lock, then restore the interrupt state `irqs`.
+    void unlock_irqrestore(irqstate irqs) {
+        unlock();
+        irqs.restore();
+    }
+
+  private:
+    void note_acquired([[maybe_unused]] unsigned long spins) {
+#if WEENSYOS_LOCKSTATS
+        lockstats_acquired(stats_id_, this, spins);
+#endif
+    }
+};
+
+
+// mcs_lock
+//    A queue lock. Each acquirer supplies a `mcs_lock::node`, usually
+//    on its stack, that stays in place until it releases the lock.
+
+struct mcs_lock {
+    struct node {
+        std::atomic<node*> next_ = nullptr;
+        std::atomic<bool> locked_ = false;
+    };
+
+    std::atomic<node*> tail_ = nullptr;
+#if WEENSYOS_LOCKSTATS
+    uint8_t stats_id_ = 0;              // `lockstats_table` index + 1, or 0
+#endif
+
+
+    // Acquire the lock using queue node `n`.
+    void lock(node& n) {
+        n.next_.store(nullptr, std::memory_order_relaxed);
+        n.locked_.store(true, std::memory_order_relaxed);
+        node* prev = tail_.exchange(&n, std::memory_order_acq_rel);
+        unsigned long spins = 0;
+        if (prev) {
+            prev->next_.store(&n, std::memory_order_release);
+            while (n.locked_.load(std::memory_order_acquire)) {
+                pause();
+                ++spins;
+            }
+        }
+        note_acquired(spins);
+    }
+
+    // Acquire the lock using `n` if it is available. Returns true on
+    // success.
+    bool try_lock(node& n) {
+        n.next_.store(nullptr, std::memory_order_relaxed);
+        node* expected = nullptr;
+        if (!tail_.compare_exchange_strong(expected, &n,
+                                           std::memory_order_acquire,
+                                           std::memory_order_relaxed)) {
+            return false;
+        }
+        note_acquired(0);
+        return true;
+    }
+
+    // Release the lock, which was acquired using `n`.
+    void unlock(node& n) {
+#if WEENSYOS_LOCKSTATS
+        lockstats_released(stats_id_);
+#endif
+        node* succ = n.next_.load(std::memory_order_acquire);
+        if (!succ) {
+            node* expected = &n;
+            if (tail_.compare_exchange_strong(expected, nullptr,
+                                              std::memory_order_release,
+                                              std::memory_order_relaxed)) {
+                return;
+            }
+            // a new waiter is linking itself in
+            while (!(succ = n.next_.load(std::memory_order_acquire))) {
+                pause();
+            }
+        }
+        succ->locked_.store(false, std::memory_order_release);
+    }
+
+    // Return true iff the lock is currently held (by any CPU).
+    bool is_locked() const {
+        return tail_.load(std::memory_order_relaxed) != nullptr;
+    }
+
+    irqstate lock_irqsave(node& n) {
+        irqstate irqs = irqstate::disable();
+        lock(n);
+        return irqs;
+    }
+
+    void unlock_irqrestore(node& n, irqstate irqs) {
+        unlock(n);
+        irqs.restore();
+    }
+
+  private:
+    void note_acquired([[maybe_unused]] unsigned long spins) {
+#if WEENSYOS_LOCKSTATS
+        lockstats_acquired(stats_id_, this, spins);
+#endif
+    }
+};
+
+
+// spinlock_guard
+//    Holds a spinlock for the lifetime of the guard object.
+
+struct spinlock_guard {
+    spinlock& lock_;
+
+    explicit spinlock_guard(spinlock& lock)
+        : lock_(lock) {
+        lock_.lock();
+    }
+    ~spinlock_guard() {
+        lock_.unlock();
+    }
+
+    NO_COPY_OR_ASSIGN(spinlock_guard)
+};
+
+
+// spinlock_irqsave_guard
+//    Holds a spinlock, with interrupts disabled, for the lifetime of the
+//    guard object.
+
+struct spinlock_irqsave_guard {
+    spinlock& lock_;
+    irqstate irqs_;
+
+    explicit spinlock_irqsave_guard(spinlock& lock)
+        : lock_(lock), irqs_(lock_.lock_irqsave()) {
+    }
+    ~spinlock_irqsave_guard() {
+        lock_.unlock_irqrestore(irqs_);
+    }
+
+    NO_COPY_OR_ASSIGN(spinlock_irqsave_guard)
+};
+
+
+// mcs_lock_guard
+//    Holds an MCS lock for the lifetime of the guard object, using a
+//    queue node in the guard.
+
+struct mcs_lock_guard {
+    mcs_lock& lock_;
+    mcs_lock::node node_;
+
+    explicit mcs_lock_guard(mcs_lock& lock)
+        : lock_(lock) {
+        lock_.lock(node_);
+    }
+    ~mcs_lock_guard() {
+        lock_.unlock(node_);
+    }
+
+    NO_COPY_OR_ASSIGN(mcs_lock_guard)
+};
+
+#endif
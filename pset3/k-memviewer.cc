@@ -5,6 +5,12 @@
 //
 //    The `memusage` class tracks memory usage by walking page tables,
 //    looks for errors, and prints the memory map to the console.
+//
+//    Walking every page table on every kernel entry is expensive, so the
+//    viewer is incremental. The page allocator marks pages dirty with
+//    `memviewer_mark_dirty`, and code that changes page table mappings calls
+//    `memviewer_mark_remapped`. A redraw repaints only dirty pages unless
+//    mappings changed, in which case it re-walks the page tables.
 
 
 class memusage {
@@ -22,10 +28,12 @@ class memusage {
     static constexpr unsigned f_kernel = 1;      // kernel-restricted
     static constexpr unsigned f_user = 2;        // user-accessible
     static constexpr unsigned f_nonidentity = 4; // not identity mapped
-    // `f_process(pid)` is for memory associated with process `pid`
+    // `f_process(pid)` is for memory associated with process `pid`.
+    // Pids 29 and up share one flag, so their pages display as '?' and
+    // cannot be told apart (see `PID_MAX` in `lib.hh`).
     static constexpr unsigned f_process(int pid) {
         if (pid >= 29) {
-            return 4U << 31;
+            return 1U << 31;
         } else if (pid >= 1) {
             return 4U << pid;
         } else {
@@ -38,6 +46,40 @@ class memusage {
 
     // Refresh the memory map from current state
     void refresh();
+    // Refresh the memory map if mappings changed since the last refresh;
+    // return true iff the map was refreshed
+    bool refresh_if_remapped();
+
+    // Mark physical page `pa` as changed since the last redraw
+    // (Any CPU may call this, so the dirty state is atomic.)
+    void mark_dirty(uintptr_t pa) {
+        if (pa < maxpa) {
+            unsigned pn = pa / PAGESIZE;
+            dirty_[pn / 64].fetch_or(1UL << (pn % 64),
+                                     std::memory_order_relaxed);
+        }
+        any_dirty_ = true;
+        // without separate page tables, ownership comes from `physpages`
+        if (!separate_tables_) {
+            remapped_ = true;
+        }
+    }
+    // Mark page table mappings as changed since the last refresh
+    void mark_remapped() {
+        remapped_ = true;
+    }
+    // Return true iff any page is dirty or mappings changed
+    bool any_dirty() const {
+        return any_dirty_ || remapped_;
+    }
+    // Start a redraw: return the dirty bits for physical pages
+    // `[64*W, 64*W+64)` in `dirty[W]`, and clear them
+    void take_dirty(uint64_t* dirty) {
+        any_dirty_ = false;
+        for (unsigned w = 0; w != maxpa / PAGESIZE / 64; ++w) {
+            dirty[w] = dirty_[w].exchange(0, std::memory_order_relaxed);
+        }
+    }
 
     // Return the symbol (character & color) associated with `pa`
     uint16_t symbol_at(uintptr_t pa) const;
@@ -55,7 +97,10 @@ class memusage {
     unsigned* v_ = nullptr;
     mutable unsigned nerrors_ = 0;
     bool separate_tables_ = false;
+    std::atomic<bool> remapped_ = true;
+    std::atomic<bool> any_dirty_ = true;
     int error_sympos_ = -1;
+    std::atomic<uint64_t> dirty_[maxpa / PAGESIZE / 64] = {};
 
     // add `flags` to the page containing `pa`
     // This is safe to call even if `pa >= maxpa`.
@@ -75,9 +120,10 @@ class memusage {
 
 // memusage::refresh()
 //    Calculate the current physical usage map, using the current process
-//    table.
+//    table. The caller must hold `ptable_lock`.
 
 void memusage::refresh() {
+    remapped_ = false;
     if (!v_) {
         v_ = reinterpret_cast<unsigned*>(kalloc(PAGESIZE));
         assert(v_ != nullptr);
@@ -94,9 +140,9 @@ void memusage::refresh() {
 
     // mark pages accessible from each process's page table
     separate_tables_ = false;
-    for (int pid = 1; pid < PID_MAX; ++pid) {
+    for (pid_t pid = next_pid(0); pid; pid = next_pid(pid)) {
         unsigned pidflag = f_process(pid);
-        proc* p = &ptable[pid];
+        proc* p = ptable[pid];
         if (p->state != P_FREE
             && p->pagetable
             && p->pagetable != kernel_pagetable) {
@@ -138,6 +184,14 @@ void memusage::refresh() {
     }
 }
 
+bool memusage::refresh_if_remapped() {
+    if (!remapped_ && v_) {
+        return false;
+    }
+    refresh();
+    return true;
+}
+
 void memusage::page_error(uintptr_t pa, const char* desc, int pid) const {
     if (error_sympos_ >= 0 && error_sympos_ < END_CPOS) {
         console[error_sympos_] = '*' | 0xF400;
@@ -198,7 +252,10 @@ uint16_t memusage::symbol_at(uintptr_t pa) const {
     } else {
         auto vx = v & ~f_nonidentity;
         if (vx == 0) {
-            if (physpages[pn].used()) {
+            if (physpages[pn].used() && physpages[pn].kmalloced) {
+                // kernel objects from `kmalloc`
+                return 'K' | 0x0D00;
+            } else if (physpages[pn].used()) {
                 // Leaked page: used but not referenced by anything we know
                 return 'L' | 0x0300;
             } else {
@@ -274,13 +331,48 @@ static void console_memviewer_virtual(memusage& mu, proc* vmp) {
 }
 
 
+static memusage mu;
+
+void memviewer_mark_dirty(uintptr_t pa) {
+    mu.mark_dirty(pa);
+}
+
+void memviewer_mark_remapped() {
+    mu.mark_remapped();
+}
+
+
 void console_memviewer(proc* vmp) {
     // Process 0 must never be used.
-    assert(ptable[0].state == P_FREE);
+    assert(ptable[0] == nullptr);
+
+    // nothing to do if memory is unchanged and we show the same process
+    // (compare pids and page tables: a freed descriptor may be reallocated
+    // at the same address for another process)
+    static pid_t last_pid = 0;
+    static x86_64_pagetable* last_pagetable = nullptr;
+    static int last_state = P_FREE;
+    bool same_vmp = vmp
+        ? vmp->pid == last_pid
+          && vmp->pagetable == last_pagetable
+          && vmp->state == last_state
+        : last_pid == 0;
+    if (!mu.any_dirty() && same_vmp) {
+        return;
+    }
+    if (!same_vmp) {
+        // switching processes is also a good time to catch mapping
+        // changes made without `memviewer_mark_remapped`
+        mu.mark_remapped();
+    }
+    last_pid = vmp ? vmp->pid : 0;
+    last_pagetable = vmp ? vmp->pagetable : nullptr;
+    last_state = vmp ? vmp->state : P_FREE;
 
     // track physical memory
-    static memusage mu;
-    mu.refresh();
+    uint64_t dirty[memusage::maxpa / PAGESIZE / 64];
+    mu.take_dirty(dirty);
+    bool redraw_all = mu.refresh_if_remapped();
 
     // print physical memory
     console_printf(CPOS(0, 32), 0x0F00, "PHYSICAL MEMORY\n");
@@ -288,13 +380,15 @@ void console_memviewer(proc* vmp) {
         if (pn % 64 == 0) {
             console_printf(mu.sympos(1, pn) - 9, 0x0F00, "0x%06X ", pn << 12);
         }
-        mu.set_error_sympos(mu.sympos(1, pn));
-        console[mu.sympos(1, pn)] = mu.symbol_at(pn * PAGESIZE);
+        if (redraw_all || (dirty[pn / 64] & (1UL << (pn % 64)))) {
+            mu.set_error_sympos(mu.sympos(1, pn));
+            console[mu.sympos(1, pn)] = mu.symbol_at(pn * PAGESIZE);
+        }
     }
     mu.set_error_sympos(-1);
 
     // print virtual memory
-    if (vmp) {
+    if (vmp && (redraw_all || !same_vmp)) {
         console_memviewer_virtual(mu, vmp);
     }
 }
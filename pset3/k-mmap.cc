@@ -0,0 +1,248 @@
+#include "kernel.hh"
+#include "k-vmiter.hh"
+
+// k-mmap.cc
+//
+//    Anonymous memory regions: SYSCALL_MMAP and SYSCALL_MUNMAP.
+//
+//    `sys_mmap` only records a region (a `vma`) in the process's sorted
+//    region list; pages are allocated, zeroed, and mapped by `vma_fault`
+//    when the process first touches them. `sys_munmap` removes a range
+//    from the list, unmaps its present pages, and frees them (and any
+//    page table pages left empty) only after a TLB shootdown.
+//
+//    Processes that share `kernel_pagetable`, as in the handout code, also
+//    share its mappings. Their regions must stay above the kernel's
+//    identity mapping, and must not overlap each other's regions.
+
+struct vma {
+    uintptr_t start;                    // first address (page-aligned)
+    uintptr_t end;                      // one past last address
+    vma* next;                          // next region by address
+};
+
+static spinlock vma_lock;               // protects every `proc::vmas`
+
+
+// find_conflict(p, start, end)
+//    Return 0 if `p` can map [start, end): no region of any process using
+//    `p`'s page table overlaps it, and nothing is mapped there. Otherwise
+//    return an address past the conflict. The caller must hold `vma_lock`
+//    and `ptable_lock`.
+
+static uintptr_t find_conflict(proc* p, uintptr_t start, uintptr_t end) {
+    for (pid_t pid = next_pid(0); pid; pid = next_pid(pid)) {
+        proc* q = ptable[pid];
+        if (q->pagetable != p->pagetable) {
+            continue;
+        }
+        for (vma* v = q->vmas; v && v->start < end; v = v->next) {
+            if (v->end > start) {
+                return v->end;
+            }
+        }
+    }
+    for (vmiter it(p, start); it.va() < end; it.next()) {
+        if (it.present()) {
+            return it.va() + PAGESIZE;
+        }
+    }
+    return 0;
+}
+
+
+// syscall_mmap(addr, sz)
+//    Handle the SYSCALL_MMAP system call. Returns the region's address.
+
+uintptr_t syscall_mmap(uintptr_t addr, size_t sz) {
+    proc* p = current();
+    uintptr_t lo = PROC_START_ADDR;
+    if (p->pagetable == kernel_pagetable) {
+        lo = MEMSIZE_PHYSICAL;
+    }
+    sz = round_up(sz, PAGESIZE);
+    if (sz == 0
+        || sz > MEMSIZE_VIRTUAL - lo
+        || addr % PAGESIZE != 0
+        || (addr != 0 && (addr < lo || addr > MEMSIZE_VIRTUAL - sz))) {
+        return E_INVAL;
+    }
+    vma* nv = reinterpret_cast<vma*>(kmalloc(sizeof(vma)));
+    if (!nv) {
+        return E_NOMEM;
+    }
+
+    spinlock_guard guard(ptable_lock);
+    spinlock_guard vguard(vma_lock);
+    if (addr != 0) {
+        if (find_conflict(p, addr, addr + sz) != 0) {
+            kfree(nv);
+            return E_INVAL;
+        }
+    } else {
+        // first fit
+        addr = lo;
+        while (uintptr_t next = find_conflict(p, addr, addr + sz)) {
+            addr = round_up(next, PAGESIZE);
+            if (addr > MEMSIZE_VIRTUAL - sz) {
+                kfree(nv);
+                return E_NOMEM;
+            }
+        }
+    }
+
+    vma** pp = &p->vmas;
+    while (*pp && (*pp)->start < addr) {
+        pp = &(*pp)->next;
+    }
+    nv->start = addr;
+    nv->end = addr + sz;
+    nv->next = *pp;
+    *pp = nv;
+    return addr;
+}
+
+
+// unmap_range(p, start, end)
+//    Unmap and free `p`'s pages in [start, end), which must lie within
+//    `p`'s regions. PTEs are cleared in batches of UNMAP_BATCH, and each
+//    batch is freed only after `invalidate_tlb` so no CPU can still reach
+//    a freed page. Then frees page table pages that mapped only
+//    [start, end). The caller must hold `vma_lock`.
+
+#define UNMAP_BATCH 16
+
+static void unmap_range(proc* p, uintptr_t start, uintptr_t end) {
+    void* batch[UNMAP_BATCH];
+    size_t n = 0;
+    for (vmiter it(p, start); it.va() < end; it.next()) {
+        if (it.present()) {
+            batch[n++] = it.kptr();
+            it.unmap_noflush();
+        }
+        if (n == UNMAP_BATCH) {
+            invalidate_tlb(p->pagetable);
+            for (size_t i = 0; i != n; ++i) {
+                kfree(batch[i]);
+            }
+            n = 0;
+        }
+    }
+    if (n != 0) {
+        invalidate_tlb(p->pagetable);
+        for (size_t i = 0; i != n; ++i) {
+            kfree(batch[i]);
+        }
+    }
+    prune_pagetable(p->pagetable, start, end);
+}
+
+
+// syscall_munmap(addr, sz)
+//    Handle the SYSCALL_MUNMAP system call. Parts of the range outside
+//    any region are ignored.
+
+int syscall_munmap(uintptr_t addr, size_t sz) {
+    proc* p = current();
+    sz = round_up(sz, PAGESIZE);
+    if (addr % PAGESIZE != 0 || addr + sz < addr) {
+        return E_INVAL;
+    }
+    uintptr_t end = addr + sz;
+    // Removing the middle of a region splits it in two.
+    vma* spare = reinterpret_cast<vma*>(kmalloc(sizeof(vma)));
+
+    spinlock_guard guard(vma_lock);
+    for (vma** pp = &p->vmas; *pp && (*pp)->start < end; ) {
+        vma* v = *pp;
+        if (v->end <= addr) {
+            pp = &v->next;
+            continue;
+        }
+        if (v->start < addr && v->end > end) {
+            if (!spare) {
+                return E_NOMEM;
+            }
+            spare->start = end;
+            spare->end = v->end;
+            spare->next = v->next;
+            v->next = spare;
+            spare = nullptr;
+        }
+
+        // free this region's pages in the range
+        uintptr_t lo = max(v->start, addr);
+        uintptr_t hi = min(v->end, end);
+        unmap_range(p, lo, hi);
+
+        if (v->start < lo) {
+            v->end = lo;
+            pp = &v->next;
+        } else if (v->end > hi) {
+            v->start = hi;
+            pp = &v->next;
+        } else {
+            *pp = v->next;
+            kfree(v);
+        }
+    }
+    kfree(spare);
+    return 0;
+}
+
+
+// vma_release(p)
+//    Unmap and free all of `p`'s regions.
+
+void vma_release(proc* p) {
+    spinlock_guard guard(vma_lock);
+    while (vma* v = p->vmas) {
+        p->vmas = v->next;
+        unmap_range(p, v->start, v->end);
+        kfree(v);
+    }
+}
+
+
+bool vma_fault(proc* p, uintptr_t addr) {
+    {
+        spinlock_guard guard(vma_lock);
+        vma* v = p->vmas;
+        while (v && v->end <= addr) {
+            v = v->next;
+        }
+        if (!v || v->start > addr) {
+            return false;
+        }
+    }
+    // Only `p` changes its regions, so the region is still there.
+    void* kptr = kzalloc(PAGESIZE);
+    if (!kptr) {
+        return false;
+    }
+    uintptr_t va = round_down(addr, PAGESIZE);
+    if (vmiter(p, va).try_map(kptr, PTE_P | PTE_W | PTE_U) < 0) {
+        kfree(kptr);
+        return false;
+    }
+    spinlock_guard guard(page_lock);
+    physpages[kptr2pa(kptr) / PAGESIZE].owner = p->pid;
+    return true;
+}
+
+
+bool vma_populate(proc* p, uintptr_t addr, size_t sz) {
+    if (sz == 0) {
+        return true;
+    }
+    uintptr_t end = addr + sz;
+    if (end < addr || end > MEMSIZE_VIRTUAL) {
+        return false;
+    }
+    for (uintptr_t va = round_down(addr, PAGESIZE); va < end; va += PAGESIZE) {
+        if (!vmiter(p, va).present() && !vma_fault(p, va)) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,184 @@
+#include "kernel.hh"
+#include "k-vmiter.hh"
+
+// k-pipe.cc
+//
+//    Pipes: byte queues between processes.
+//
+//    Each pipe buffers up to PIPE_BUFSIZE bytes in a ring. Readers of an
+//    empty pipe and writers to a full pipe block on the pipe's wait lists;
+//    the other side wakes them directly when it makes progress. A write to
+//    an empty pipe with a blocked reader copies straight into the reader's
+//    memory, skipping the ring. All copies go a page at a time through
+//    `vmcopy`.
+//
+//    A pipe's slot in `pipes` is never freed, so looking up an ID needs no
+//    lock; only its ring buffer is allocated. A slot with no buffer is
+//    closed, and every operation checks that under the pipe's lock.
+
+#define PIPE_MAX        16              // number of pipes
+#define PIPE_BUFSIZE    PAGESIZE        // bytes buffered per pipe
+
+struct pipestate {
+    spinlock lock_;                     // protects all members
+    char* buf_ = nullptr;               // ring buffer; nullptr if closed
+    size_t head_ = 0;                   // ring index of first unread byte
+    size_t len_ = 0;                    // number of unread bytes
+    proc* readers_ = nullptr;           // processes waiting for data
+    proc* writers_ = nullptr;           // processes waiting for space
+};
+
+static pipestate pipes[PIPE_MAX];
+
+static pipestate* find_pipe(uintptr_t id) {
+    return id < PIPE_MAX ? &pipes[id] : nullptr;
+}
+
+
+// syscall_pipe()
+//    Handle the SYSCALL_PIPE system call. Returns a pipe ID.
+
+int syscall_pipe() {
+    char* buf = reinterpret_cast<char*>(kmalloc(PIPE_BUFSIZE));
+    if (!buf) {
+        return E_NOMEM;
+    }
+    for (int id = 0; id != PIPE_MAX; ++id) {
+        spinlock_guard guard(pipes[id].lock_);
+        if (!pipes[id].buf_) {
+            pipes[id].buf_ = buf;
+            return id;
+        }
+    }
+    kfree(buf);
+    return E_NOMEM;
+}
+
+
+// syscall_pipe_close(id)
+//    Handle the SYSCALL_PIPE_CLOSE system call. Blocked readers and
+//    writers retry their calls and find the pipe closed.
+
+int syscall_pipe_close(uintptr_t id) {
+    pipestate* ppp = find_pipe(id);
+    if (!ppp) {
+        return E_INVAL;
+    }
+    pipestate& pp = *ppp;
+    pp.lock_.lock();
+    char* buf = pp.buf_;
+    if (!buf) {
+        pp.lock_.unlock();
+        return E_INVAL;
+    }
+    pp.buf_ = nullptr;
+    pp.head_ = pp.len_ = 0;
+    wake_all(pp.readers_);
+    wake_all(pp.writers_);
+    pp.lock_.unlock();
+    kfree(buf);
+    return 0;
+}
+
+
+// syscall_pipe_read(id, addr, sz)
+//    Handle the SYSCALL_PIPE_READ system call.
+
+ssize_t syscall_pipe_read(uintptr_t id, uintptr_t addr, size_t sz) {
+    proc* p = current();
+    pipestate* ppp = find_pipe(id);
+    if (!ppp
+        || !vma_populate(p, addr, sz)
+        || !vmiter(p, addr).range_perm(sz, PTE_P | PTE_W | PTE_U)) {
+        return E_INVAL;
+    }
+    if (sz == 0) {
+        return 0;
+    }
+    pipestate& pp = *ppp;
+    pp.lock_.lock();
+    if (!pp.buf_) {
+        pp.lock_.unlock();
+        return E_INVAL;
+    }
+
+    if (pp.len_ == 0) {
+        // Wait for data, then retry. (A writer may instead complete this
+        // call directly; see `syscall_pipe_write`.)
+        p->regs.reg_rip -= 2;
+        block_current(pp.readers_, pp.lock_);
+    }
+
+    size_t n = min(sz, pp.len_);
+    size_t n1 = min(n, PIPE_BUFSIZE - pp.head_);
+    vmcopy(p->pagetable, addr,
+           kernel_pagetable, kptr2pa(pp.buf_ + pp.head_), n1);
+    vmcopy(p->pagetable, addr + n1,
+           kernel_pagetable, kptr2pa(pp.buf_), n - n1);
+    pp.head_ = (pp.head_ + n) % PIPE_BUFSIZE;
+    pp.len_ -= n;
+
+    wake_all(pp.writers_);
+    pp.lock_.unlock();
+    return n;
+}
+
+
+// syscall_pipe_write(id, addr, sz)
+//    Handle the SYSCALL_PIPE_WRITE system call.
+
+ssize_t syscall_pipe_write(uintptr_t id, uintptr_t addr, size_t sz) {
+    proc* p = current();
+    pipestate* ppp = find_pipe(id);
+    if (!ppp
+        || !vma_populate(p, addr, sz)
+        || !vmiter(p, addr).range_perm(sz, PTE_P | PTE_U)) {
+        return E_INVAL;
+    }
+    pipestate& pp = *ppp;
+    pp.lock_.lock();
+    if (!pp.buf_) {
+        pp.lock_.unlock();
+        return E_INVAL;
+    }
+
+    // Nothing buffered: hand data straight to blocked readers. Each
+    // reader's `pipe_read` arguments are in its saved registers, and its
+    // memory was checked before it blocked.
+    size_t pos = 0;
+    while (pp.len_ == 0 && pp.readers_ && pos != sz) {
+        proc* r = pp.readers_;
+        pp.readers_ = r->wait_next;
+        size_t n = min(sz - pos, size_t(r->regs.reg_rdx));
+        vmcopy(r->pagetable, r->regs.reg_rsi, p->pagetable, addr + pos, n);
+        pos += n;
+        r->regs.reg_rax = n;
+        r->regs.reg_rip += 2;           // complete, rather than retry, read
+        wake(r);
+    }
+
+    if (pos == sz) {
+        pp.lock_.unlock();
+        return sz;
+    }
+    if (pp.len_ == PIPE_BUFSIZE && pos == 0) {
+        // Wait for space, then retry.
+        p->regs.reg_rip -= 2;
+        block_current(pp.writers_, pp.lock_);
+    }
+
+    // Buffer what fits.
+    size_t n = min(sz - pos, PIPE_BUFSIZE - pp.len_);
+    size_t tail = (pp.head_ + pp.len_) % PIPE_BUFSIZE;
+    size_t n1 = min(n, PIPE_BUFSIZE - tail);
+    vmcopy(kernel_pagetable, kptr2pa(pp.buf_ + tail),
+           p->pagetable, addr + pos, n1);
+    vmcopy(kernel_pagetable, kptr2pa(pp.buf_),
+           p->pagetable, addr + pos + n1, n - n1);
+    pp.len_ += n;
+    pos += n;
+
+    wake_all(pp.readers_);
+    pp.lock_.unlock();
+    return pos;
+}
@@ -0,0 +1,103 @@
+#include "kernel.hh"
+
+// k-profile.cc
+//
+//    A sampling profiler. While it is on, each timer interrupt adds one
+//    sample for the interrupted (process, %rip) pair to a hash table held
+//    in one `kalloc`ed page. Turning it off writes the table to `log.txt`,
+//    most frequent first, with kernel addresses symbolized by
+//    `lookup_symbol`. Processes have no symbols in the kernel; look up
+//    their addresses in `obj/p-*.sym`.
+//
+//    The kernel runs with interrupts disabled except when a CPU is idle,
+//    so kernel samples (pid 0) measure idle time.
+
+struct profile_slot {
+    uintptr_t rip;
+    int32_t pid;                        // 0 means kernel
+    uint32_t count;                     // 0 means empty slot
+};
+
+#define PROFILE_NSLOTS  (PAGESIZE / sizeof(profile_slot))
+
+static spinlock profile_lock;           // protects all profiler state
+static profile_slot* profile_slots;     // `nullptr` when profiler is off
+static unsigned long profile_nsamples;
+static unsigned long profile_ndropped;  // samples lost to a full table
+
+
+void profile_sample(const regstate* regs) {
+    spinlock_guard guard(profile_lock);
+    if (!profile_slots) {
+        return;
+    }
+    int pid = (regs->reg_cs & 3) && current() ? current()->pid : 0;
+    ++profile_nsamples;
+
+    // open addressing with linear probing
+    uint64_t h = (regs->reg_rip ^ (uint64_t(pid) << 48))
+        * 0x9E3779B97F4A7C15UL;
+    for (size_t n = 0; n != PROFILE_NSLOTS; ++n) {
+        profile_slot& s = profile_slots[((h >> 56) + n) % PROFILE_NSLOTS];
+        if (s.count == 0) {
+            s.rip = regs->reg_rip;
+            s.pid = pid;
+        }
+        if (s.rip == regs->reg_rip && s.pid == pid) {
+            ++s.count;
+            return;
+        }
+    }
+    ++profile_ndropped;
+}
+
+
+void profile_toggle() {
+    profile_lock.lock();
+    profile_slot* slots = profile_slots;
+    if (!slots) {
+        profile_slots = reinterpret_cast<profile_slot*>(kzalloc(PAGESIZE));
+        profile_nsamples = profile_ndropped = 0;
+        bool ok = profile_slots != nullptr;
+        profile_lock.unlock();
+        console_printf(CPOS(24, 0), 0x0E00, ok ? "PROFILING\n"
+                       : "Cannot allocate profile!\n");
+        return;
+    }
+    profile_slots = nullptr;
+    unsigned long nsamples = profile_nsamples;
+    unsigned long ndropped = profile_ndropped;
+    profile_lock.unlock();
+
+    // insertion sort by decreasing count (empty slots sink to the end)
+    for (size_t i = 1; i != PROFILE_NSLOTS; ++i) {
+        profile_slot s = slots[i];
+        size_t j = i;
+        for (; j != 0 && slots[j - 1].count < s.count; --j) {
+            slots[j] = slots[j - 1];
+        }
+        slots[j] = s;
+    }
+
+    log_printf("\nWEENSYOS PROFILE samples=%lu dropped=%lu\n",
+               nsamples, ndropped);
+    for (size_t i = 0; i != PROFILE_NSLOTS && slots[i].count; ++i) {
+        auto& s = slots[i];
+        unsigned pct10 = s.count * 1000UL / nsamples;
+        const char* name;
+        uintptr_t start;
+        if (s.pid == 0 && lookup_symbol(s.rip, &name, &start)) {
+            log_printf("%7u %3u.%u%%  kernel  %p  <%s+%#lx>\n", s.count,
+                       pct10 / 10, pct10 % 10, s.rip, name, s.rip - start);
+        } else if (s.pid == 0) {
+            log_printf("%7u %3u.%u%%  kernel  %p\n", s.count,
+                       pct10 / 10, pct10 % 10, s.rip);
+        } else {
+            log_printf("%7u %3u.%u%%  pid %-3d %p\n", s.count,
+                       pct10 / 10, pct10 % 10, s.pid, s.rip);
+        }
+    }
+    log_printf("WEENSYOS PROFILE END\n");
+    console_printf(CPOS(24, 0), 0x0E00, "Profile written to log.txt\n");
+    kfree(slots);
+}
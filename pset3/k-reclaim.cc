@@ -0,0 +1,138 @@
+#include "kernel.hh"
+#include "k-vmiter.hh"
+
+// k-reclaim.cc
+//
+//    Page reclaim: what `kalloc` tries before reporting out-of-memory.
+//
+//    Two kinds of allocated page can be freed without losing data: empty
+//    slab pages that `kmalloc` keeps in reserve, and clean program text.
+//    A process's read-only segments are copies of its `program_image`, so
+//    a text page can be unmapped and freed; `reload_text` maps a fresh
+//    copy when the process next touches it.
+//
+//    Text is only dropped from processes with their own page tables.
+//    Processes that share `kernel_pagetable`, as in the handout code, run
+//    on the kernel's identity mapping, which must not change; until
+//    `process_setup` gives processes private page tables, only slab pages
+//    are reclaimed. Dropped pages are freed only after a TLB shootdown.
+//    A process that touches one of them meanwhile faults and gets a fresh
+//    copy from `reload_text`.
+
+#define RECLAIM_BATCH   8       // most text pages dropped per call
+
+
+static bool running(proc* p) {
+    for (int i = 0; i != ncpu; ++i) {
+        if (cpu_state(i)->current_ == p) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// drop_text(p, max)
+//    Unmap and free up to `max` of `p`'s clean text pages. Returns the
+//    number freed.
+
+static size_t drop_text(proc* p, size_t max) {
+    assert(max <= RECLAIM_BATCH);
+    void* batch[RECLAIM_BATCH];
+    size_t n = 0;
+    program_image pgm(p->program);
+    for (auto seg = pgm.begin(); seg != pgm.end() && n != max; ++seg) {
+        if (seg.writable()) {
+            continue;
+        }
+        for (vmiter it(p, round_down(seg.va(), PAGESIZE));
+             it.va() < seg.va() + seg.size() && n != max;
+             it += PAGESIZE) {
+            if (!it.user()
+                || it.writable()
+                || !allocatable_physical_address(it.pa())) {
+                continue;
+            }
+            // skip shared (e.g., forked) pages
+            spinlock_guard guard(page_lock);
+            if (physpages[it.pa() / PAGESIZE].refcount == 1) {
+                batch[n] = it.kptr();
+                ++n;
+                it.unmap_noflush();
+            }
+        }
+    }
+    if (n != 0) {
+        invalidate_tlb(p->pagetable);
+        for (size_t i = 0; i != n; ++i) {
+            kfree(batch[i]);
+        }
+    }
+    return n;
+}
+
+
+size_t reclaim_pages() {
+    size_t n = slab_reclaim();
+    // Our caller may hold `ptable_lock`; don't wait for it.
+    if (n != 0 || !ptable_lock.try_lock()) {
+        return n;
+    }
+    // Start after the last process we took text from, so that one
+    // process doesn't keep losing its text.
+    static pid_t last_victim = 0;       // protected by `ptable_lock`
+    pid_t start = last_victim;
+    for (int pass = 0; pass != 2 && n < RECLAIM_BATCH; ++pass) {
+        for (pid_t pid = next_pid(pass == 0 ? start : 0);
+             pid && (pass == 0 || pid <= start) && n < RECLAIM_BATCH;
+             pid = next_pid(pid)) {
+            proc* p = ptable[pid];
+            // prefer processes that aren't running right now
+            if (p->pagetable != kernel_pagetable
+                && p->program >= 0
+                && !running(p)) {
+                size_t m = drop_text(p, RECLAIM_BATCH - n);
+                if (m != 0) {
+                    n += m;
+                    last_victim = pid;
+                }
+            }
+        }
+    }
+    ptable_lock.unlock();
+    return n;
+}
+
+
+bool reload_text(proc* p, uintptr_t addr) {
+    if (p->pagetable == kernel_pagetable || p->program < 0) {
+        return false;
+    }
+    uintptr_t va = round_down(addr, PAGESIZE);
+    program_image pgm(p->program);
+    for (auto seg = pgm.begin(); seg != pgm.end(); ++seg) {
+        if (seg.writable()
+            || va + PAGESIZE <= seg.va()
+            || va >= seg.va() + seg.size()) {
+            continue;
+        }
+        char* kptr = reinterpret_cast<char*>(kalloc(PAGESIZE));
+        if (!kptr) {
+            return false;
+        }
+        // copy the part of the segment's file data on this page
+        memset(kptr, 0, PAGESIZE);
+        uintptr_t lo = max(va, seg.va());
+        uintptr_t hi = min(va + PAGESIZE, seg.va() + seg.data_size());
+        if (lo < hi) {
+            memcpy(kptr + (lo - va), seg.data() + (lo - seg.va()), hi - lo);
+        }
+        if (vmiter(p, va).try_map(kptr, PTE_P | PTE_U) < 0) {
+            kfree(kptr);
+            return false;
+        }
+        spinlock_guard guard(page_lock);
+        physpages[kptr2pa(kptr) / PAGESIZE].owner = p->pid;
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,138 @@
+#include "kernel.hh"
+
+// k-slab.cc
+//
+//    `kmalloc`, a slab allocator for small kernel objects.
+//
+//    Each power-of-two size class from SLAB_MINSIZE to SLAB_MAXSIZE has a
+//    cache of slab pages obtained from `kalloc`. A slab page holds objects
+//    of one size class. Its bookkeeping lives in its `physpages` entry, so
+//    the whole page is usable: free objects form a list threaded through
+//    the objects themselves (as 16-bit page offsets), and pages with free
+//    objects form a per-class "partial" list. A slab page that becomes
+//    entirely free goes back to `kalloc`, unless it's the class's only
+//    partial page. Larger requests get a whole page. When memory runs
+//    out, `slab_reclaim` frees those retained empty pages too.
+
+#define SLAB_MINSIZE    16
+#define SLAB_NCLASSES   8
+#define SLAB_MAXSIZE    (SLAB_MINSIZE << (SLAB_NCLASSES - 1))
+#define SLAB_NONE       0xFFFF          // end of a free list
+
+static_assert(SLAB_MAXSIZE <= PAGESIZE / 2, "slab classes too large");
+static_assert(PAGESIZE / SLAB_MINSIZE <= SLAB_NONE, "slab pages too large");
+
+struct slabcache {
+    spinlock lock_;                     // protects this class's pages
+    uint16_t partial_ = 0;              // first page with free objects
+                                        // (page number; 0 means none)
+};
+
+static slabcache slabs[SLAB_NCLASSES];
+
+
+void* kmalloc(size_t sz) {
+    if (sz > SLAB_MAXSIZE) {
+        void* ptr = kalloc(sz);
+        if (ptr) {
+            physpages[kptr2pa(ptr) / PAGESIZE].kmalloced = true;
+        }
+        return ptr;
+    }
+
+    int cls = 0;
+    while ((size_t(SLAB_MINSIZE) << cls) < sz) {
+        ++cls;
+    }
+    size_t objsize = SLAB_MINSIZE << cls;
+    slabcache& sc = slabs[cls];
+    spinlock_guard guard(sc.lock_);
+
+    if (!sc.partial_) {
+        // carve a new page into objects
+        char* page = reinterpret_cast<char*>(kalloc(PAGESIZE));
+        if (!page) {
+            return nullptr;
+        }
+        for (size_t off = 0; off != PAGESIZE; off += objsize) {
+            size_t next = off + objsize;
+            *reinterpret_cast<uint16_t*>(page + off) =
+                next == PAGESIZE ? SLAB_NONE : next;
+        }
+        unsigned pn = kptr2pa(page) / PAGESIZE;
+        physpageinfo& pi = physpages[pn];
+        pi.kmalloced = true;
+        pi.slab_class = cls;
+        pi.slab_nfree = PAGESIZE / objsize;
+        pi.slab_free = 0;
+        pi.slab_next = 0;
+        sc.partial_ = pn;
+    }
+
+    physpageinfo& pi = physpages[sc.partial_];
+    char* obj = pa2kptr<char*>(sc.partial_ * PAGESIZE + pi.slab_free);
+    pi.slab_free = *reinterpret_cast<uint16_t*>(obj);
+    --pi.slab_nfree;
+    if (pi.slab_nfree == 0) {
+        sc.partial_ = pi.slab_next;
+    }
+    return obj;
+}
+
+
+void slab_free(void* ptr) {
+    uintptr_t pa = kptr2pa(ptr);
+    unsigned pn = pa / PAGESIZE;
+    physpageinfo& pi = physpages[pn];
+    int cls = pi.slab_class;
+    size_t objsize = SLAB_MINSIZE << cls;
+    assert(cls >= 0 && cls < SLAB_NCLASSES && pa % objsize == 0);
+    slabcache& sc = slabs[cls];
+    spinlock_guard guard(sc.lock_);
+    assert(pi.slab_nfree < PAGESIZE / objsize);
+
+    *reinterpret_cast<uint16_t*>(ptr) = pi.slab_free;
+    pi.slab_free = pa % PAGESIZE;
+    ++pi.slab_nfree;
+    if (pi.slab_nfree == 1) {
+        pi.slab_next = sc.partial_;
+        sc.partial_ = pn;
+    }
+
+    if (pi.slab_nfree == PAGESIZE / objsize
+        && (sc.partial_ != pn || pi.slab_next != 0)) {
+        // Page is empty and not the only partial page: unlink and free it.
+        uint16_t* pp = &sc.partial_;
+        while (*pp != pn) {
+            pp = &physpages[*pp].slab_next;
+        }
+        *pp = pi.slab_next;
+        pi.slab_class = -1;
+        kfree(pa2kptr<void*>(pn * PAGESIZE));
+    }
+}
+
+
+size_t slab_reclaim() {
+    size_t n = 0;
+    for (int cls = 0; cls != SLAB_NCLASSES; ++cls) {
+        slabcache& sc = slabs[cls];
+        // Skip busy classes: our caller may be `kmalloc` itself.
+        if (!sc.lock_.try_lock()) {
+            continue;
+        }
+        unsigned pn = sc.partial_;
+        physpageinfo& pi = physpages[pn];
+        if (pn != 0
+            && pi.slab_nfree == PAGESIZE / (SLAB_MINSIZE << cls)) {
+            // Only a class's sole partial page is ever kept empty.
+            assert(pi.slab_next == 0);
+            sc.partial_ = 0;
+            pi.slab_class = -1;
+            kfree(pa2kptr<void*>(pn * PAGESIZE));
+            ++n;
+        }
+        sc.lock_.unlock();
+    }
+    return n;
+}
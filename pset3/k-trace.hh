@@ -0,0 +1,70 @@
+#ifndef WEENSYOS_K_TRACE_HH
+#define WEENSYOS_K_TRACE_HH
+#include "kernel.hh"
+#include <atomic>
+
+// k-trace.hh
+//
+//    Kernel event tracing. `trace(type, arg0, arg1)` appends a fixed-size
+//    binary record to a global ring buffer. Recording costs one atomic
+//    increment plus a few stores, so tracing is always on.
+//
+//    Type 't' at the console to dump the ring to `log.txt`; then run
+//    `make trace` to decode it on the host (see `build/tracedecode.cc`).
+
+
+enum trace_type : uint8_t {
+    TRACE_SYSCALL = 1,          // arg0: syscall number, arg1: %rdi
+    TRACE_RETURN,               // return to user mode; arg0: %rip
+    TRACE_TIMER,                // arg0: ticks
+    TRACE_FAULT,                // arg0: faulting address, arg1: error code
+    TRACE_EXCEPTION,            // arg0: interrupt number, arg1: %rip
+    TRACE_SCHEDULE,             // arg0: chosen pid, arg1: its run queue's CPU
+    TRACE_PAGE_ALLOC,           // arg0: physical address
+    TRACE_PAGE_FREE             // arg0: physical address
+};
+
+// The record format is shared with `build/tracedecode.cc`.
+struct trace_event {
+    uint64_t tsc;               // timestamp (`rdtsc`)
+    uint32_t seq;               // low bits of sequence number; written last
+    uint8_t type;               // `trace_type`
+    uint8_t cpu;                // CPU index
+    int16_t pid;                // current process, or 0 if none
+    uint64_t arg0;
+    uint64_t arg1;
+};
+static_assert(sizeof(trace_event) == 32, "trace_event has unexpected size");
+
+#define TRACE_NEVENTS   1024    // must be a power of two
+static_assert((TRACE_NEVENTS & (TRACE_NEVENTS - 1)) == 0,
+              "TRACE_NEVENTS must be a power of two");
+
+extern trace_event trace_ring[TRACE_NEVENTS];
+extern std::atomic<uint64_t> trace_head;    // total events ever recorded
+
+
+// trace(type, arg0, arg1)
+//    Record an event for this CPU's current process.
+
+inline void trace(trace_type type, uint64_t arg0 = 0, uint64_t arg1 = 0) {
+    uint64_t seq = trace_head.fetch_add(1, std::memory_order_relaxed);
+    trace_event* e = &trace_ring[seq % TRACE_NEVENTS];
+    cpustate* c = this_cpu();
+    e->tsc = rdtsc();
+    e->type = type;
+    e->cpu = c->index_;
+    e->pid = c->current_ ? c->current_->pid : 0;
+    e->arg0 = arg0;
+    e->arg1 = arg1;
+    // A dump that races with this write can see a stale `seq` and
+    // discard the record.
+    std::atomic_signal_fence(std::memory_order_release);
+    e->seq = seq;
+}
+
+// trace_dump()
+//    Write the ring buffer to `log.txt`.
+void trace_dump();
+
+#endif
@@ -62,30 +62,154 @@ int vmiter::try_map(uintptr_t pa, int perm) {
     } else {
         assert((pa & PTE_P) == 0, "vmiter::try_map invalid pa");
     }
+    return try_map_at(pa, perm, PAGEOFFBITS);
+}
+
+int vmiter::try_map_large(uintptr_t pa, int perm) {
+    if (pa == (uintptr_t) -1 && perm == 0) {
+        pa = 0;
+    }
+    // virtual address is large-page-aligned
+    assert((va_ % LARGEPAGESIZE) == 0, "vmiter::try_map_large va not aligned");
+    if (perm & PTE_P) {
+        // if mapping present, physical address is large-page-aligned
+        assert(pa != (uintptr_t) -1,
+               "vmiter::try_map_large mapping nonexistent pa");
+        assert((pa & PTE_PS_PAMASK) == pa && (pa % LARGEPAGESIZE) == 0,
+               "vmiter::try_map_large pa not aligned");
+        perm |= PTE_PS;
+    } else {
+        assert((pa & PTE_P) == 0, "vmiter::try_map_large invalid pa");
+    }
+    // replacing a level-1 page table would leak it and its mappings
+    assert(lbits_ >= PAGEOFFBITS + PAGEINDEXBITS,
+           "vmiter::try_map_large region has a page table");
+    return try_map_at(pa, perm, PAGEOFFBITS + PAGEINDEXBITS);
+}
+
+void vmiter::unmap_noflush() {
+    assert((va_ % PAGESIZE) == 0, "vmiter::unmap_noflush va not aligned");
+    if (*pep_ & PTE_P) {
+        assert(lbits_ == PAGEOFFBITS, "vmiter::unmap_noflush large page");
+        *pep_ = 0;
+        memviewer_mark_remapped();
+    }
+}
+
+int vmiter::try_map_at(uintptr_t pa, int perm, int lbits) {
     // new permissions (`perm`) cannot be less restrictive than permissions
     // imposed by higher-level page tables (`perm_`)
     assert(!(perm & ~perm_ & (PTE_P | PTE_W | PTE_U)));
 
-    while (lbits_ > PAGEOFFBITS && perm) {
-        assert(!(*pep_ & PTE_P));
-        x86_64_pagetable* pt = static_cast<x86_64_pagetable*>(kalloc(PAGESIZE));
+    // Descend to the level that maps `1 << lbits` bytes. Adding a mapping
+    // allocates missing page table pages; a present entry above that level
+    // must be a large page, which is split into smaller pages with the same
+    // translation and permissions.
+    while (lbits_ > lbits && (perm || (*pep_ & PTE_P))) {
+        auto pt = static_cast<x86_64_pagetable*>(kzalloc(PAGESIZE));
         if (!pt) {
             return -1;
         }
-        memset(pt, 0, PAGESIZE);
+        if (*pep_ & PTE_P) {
+            assert(*pep_ & PTE_PS);
+            uintptr_t large_pa = *pep_ & PTE_PS_PAMASK;
+            uint64_t flags = *pep_ & (PTE_XD | 0xFFF) & ~PTE_PS;
+            int child_lbits = lbits_ - PAGEINDEXBITS;
+            if (child_lbits > PAGEOFFBITS) {
+                flags |= PTE_PS;
+            }
+            for (uintptr_t i = 0; i != (1U << PAGEINDEXBITS); ++i) {
+                pt->entry[i] = (large_pa + (i << child_lbits)) | flags;
+            }
+        }
         std::atomic_thread_fence(std::memory_order_release);
         *pep_ = reinterpret_cast<uintptr_t>(pt) | PTE_P | PTE_W | PTE_U;
         down();
     }
 
-    if (lbits_ == PAGEOFFBITS) {
+    if (lbits_ == lbits) {
+        x86_64_pageentry_t old_pe = *pep_;
         std::atomic_thread_fence(std::memory_order_release);
         *pep_ = pa | perm;
+        memviewer_mark_remapped();
+        // TLBs may cache the old mapping
+        if ((old_pe & PTE_P) && (old_pe & ~(PTE_A | PTE_D)) != *pep_) {
+            invalidate_tlb(pt_);
+        }
     }
     return 0;
 }
 
 
+void vmcopy(x86_64_pagetable* dstpt, uintptr_t dstva,
+            x86_64_pagetable* srcpt, uintptr_t srcva, size_t sz) {
+    vmiter dit(dstpt, dstva);
+    vmiter sit(srcpt, srcva);
+    while (sz > 0) {
+        size_t n = min(sz, PAGESIZE - dit.va() % PAGESIZE,
+                       PAGESIZE - sit.va() % PAGESIZE);
+        assert(dit.present() && sit.present());
+        memcpy(dit.kptr(), sit.kptr(), n);
+        dit += n;
+        sit += n;
+        sz -= n;
+    }
+}
+
+
+void free_pagetable(x86_64_pagetable* pt) {
+    assert(pt != kernel_pagetable);
+    // Paging-structure caches may still hold these pages. No CPU has `pt`
+    // loaded, so none can add more once they are flushed.
+    invalidate_tlb(pt);
+    // `ptiter` visits children before parents, so each page is freed
+    // after the iterator is done reading it.
+    for (ptiter it(pt); !it.done(); it.next()) {
+        kfree(it.kptr());
+    }
+    kfree(pt);
+}
+
+#define PRUNE_BATCH 16
+
+void prune_pagetable(x86_64_pagetable* pt, uintptr_t start, uintptr_t end) {
+    // Other CPUs' paging-structure caches may point to a cleared page
+    // table page until `invalidate_tlb` returns, so pages are freed in
+    // batches after the flush.
+    x86_64_pagetable* batch[PRUNE_BATCH];
+    size_t n = 0;
+    for (ptiter it(pt); !it.done(); it.next()) {
+        if (it.va() < start || it.last_va() - 1 > end - 1) {
+            continue;
+        }
+        x86_64_pagetable* child = it.kptr();
+        bool empty = true;
+        for (int i = 0; i != (1 << PAGEINDEXBITS) && empty; ++i) {
+            empty = !(child->entry[i] & PTE_P);
+        }
+        if (empty) {
+            // Children come before parents, so clearing this entry may
+            // empty its parent in turn. `next()` does not reread the
+            // cleared entry.
+            *it.pep_ = 0;
+            batch[n++] = child;
+        }
+        if (n == PRUNE_BATCH) {
+            invalidate_tlb(pt);
+            while (n > 0) {
+                kfree(batch[--n]);
+            }
+        }
+    }
+    if (n > 0) {
+        invalidate_tlb(pt);
+        while (n > 0) {
+            kfree(batch[--n]);
+        }
+    }
+}
+
+
 uint64_t vmiter::range_perm(size_t sz) const {
     uint64_t p = sz > 0 ? perm() : uint64_t(-1);
     uintptr_t sva = va_;
@@ -93,10 +93,27 @@ class vmiter {
     // `this->va()` must be page-aligned. Might call `kalloc` to allocate
     // page table pages. On success, changes the mapping and returns 0.
     // If `kalloc` fails, returns a negative error code without modifying
-    // any mappings.
+    // any mappings. Unmapping (`perm == 0`) never frees page table pages;
+    // see `prune_pagetable`.
     [[gnu::warn_unused_result]] int try_map(uintptr_t pa, int perm);
     [[gnu::warn_unused_result]] inline int try_map(void* kptr, int perm);
     [[gnu::warn_unused_result]] inline int try_map(volatile void* kptr, int perm);
+    // If `this->va()` is mapped by a large page, `map` and `try_map` first
+    // split it into smaller pages with the same translation.
+
+    // Change the mapping for the LARGEPAGESIZE-byte region starting at
+    // `this->va()` to a single large page (`PTE_PS`) at `pa` with
+    // permissions `perm`. `this->va()` and `pa` must be aligned to
+    // LARGEPAGESIZE, and the region must not be mapped by a level-1 page
+    // table. Returns 0 on success or a negative error code if `kalloc`
+    // fails.
+    [[gnu::warn_unused_result]] int try_map_large(uintptr_t pa, int perm);
+    inline void map_large(uintptr_t pa, int perm);
+
+    // Clear the 4KiB mapping for `this->va()`, if any, without flushing
+    // TLBs. Other CPUs may still use the old translation, so the caller
+    // must call `invalidate_tlb` before freeing or reusing the page.
+    void unmap_noflush();
 
   private:
     static constexpr int initial_lbits = PAGEOFFBITS + 3 * PAGEINDEXBITS;
@@ -114,6 +131,7 @@ class vmiter {
 
     inline static constexpr uintptr_t lbits_mask(int lbits);
     void down();
+    int try_map_at(uintptr_t pa, int perm, int lbits);
     void real_find(uintptr_t va, bool stepping);
     friend class ptiter;
 };
@@ -161,9 +179,36 @@ class ptiter {
     uintptr_t va_;
 
     void down(bool skip);
+    friend void prune_pagetable(x86_64_pagetable* pt, uintptr_t start,
+                                uintptr_t end);
 };
 
 
+// vmcopy(dstpt, dstva, srcpt, srcva, sz)
+//    Copy `sz` bytes from virtual address `srcva` in page table `srcpt` to
+//    `dstva` in `dstpt`, one page at a time. Both ranges must be mapped.
+//    Kernel memory can be named with `kernel_pagetable`.
+void vmcopy(x86_64_pagetable* dstpt, uintptr_t dstva,
+            x86_64_pagetable* srcpt, uintptr_t srcva, size_t sz);
+
+
+// free_pagetable(pt)
+//    Free every page table page in `pt`, including `pt` itself. Does not
+//    free the pages `pt` maps; free or unmap those first. `pt` must not be
+//    `kernel_pagetable` or be loaded on any CPU.
+void free_pagetable(x86_64_pagetable* pt);
+
+// prune_pagetable(pt, [start, end])
+//    Free the page table pages in `pt` that no longer map anything (for
+//    instance, after a range is unmapped) and clear the entries that
+//    point to them. Never frees `pt` itself. Only page table pages whose
+//    whole address range lies within [`start`, `end`) are considered
+//    (`end == 0` means no upper limit), so a caller can prune its own
+//    range of a page table that other CPUs are mapping into.
+void prune_pagetable(x86_64_pagetable* pt, uintptr_t start = 0,
+                     uintptr_t end = 0);
+
+
 inline vmiter::vmiter(x86_64_pagetable* pt, uintptr_t va)
     : pt_(pt), pep_(&pt_->entry[0]), lbits_(initial_lbits),
       perm_(initial_perm), va_(0) {
@@ -214,9 +259,9 @@ inline T vmiter::kptr() const {
     }
 }
 inline uint64_t vmiter::perm() const {
-    // Returns 0-0xFFF. (XXX Does not track PTE_XD.)
+    // Returns 0-0xFFF, never including `PTE_PS`. (XXX Does not track PTE_XD.)
     // Returns 0 unless `(*pep_ & perm_ & PTE_P) != 0`.
-    uint64_t ph = *pep_ & perm_;
+    uint64_t ph = *pep_ & perm_ & ~PTE_PS;
     return ph & -(ph & PTE_P);
 }
 inline bool vmiter::perm(uint64_t desired_perm) const {
@@ -271,6 +316,10 @@ inline void vmiter::map(uintptr_t pa, int perm) {
     int r = try_map(pa, perm);
     assert(r == 0, "vmiter::map failed");
 }
+inline void vmiter::map_large(uintptr_t pa, int perm) {
+    int r = try_map_large(pa, perm);
+    assert(r == 0, "vmiter::map_large failed");
+}
 inline void vmiter::map(void* kp, int perm) {
     assert(kp != nullptr);
     map(reinterpret_cast<uintptr_t>(kp), perm);
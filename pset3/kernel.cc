@@ -1,6 +1,7 @@
 #include "kernel.hh"
 #include "k-apic.hh"
 #include "k-vmiter.hh"
+#include "k-trace.hh"
 #include "obj/k-firstprocess.h"
 #include <atomic>
 
@@ -24,16 +25,41 @@
 
 #define PROC_SIZE 0x40000       // initial state only
 
-proc ptable[PID_MAX];           // array of process descriptors
+proc* ptable[PID_MAX];          // process descriptors, by pid
                                 // Note that `ptable[0]` is never used.
-proc* current;                  // pointer to currently executing proc
+spinlock ptable_lock;           // protects `ptable` and pid allocation
+                                // `current()` is per-CPU; see kernel.hh
+
+// Pid allocation: bit `pid % 64` of `pid_used[pid / 64]` is set iff `pid`
+// is allocated, and bit `w` of `pid_avail` is set iff `pid_used[w]` has a
+// clear bit. Finding a free pid takes two bit scans.
+#define PID_WORDS (PID_MAX / 64)
+static_assert(PID_MAX % 64 == 0 && PID_WORDS <= 64, "unsupported PID_MAX");
+static uint64_t pid_used[PID_WORDS] = { 1 };    // pid 0 is never used
+static uint64_t pid_avail = ~uint64_t(0) >> (64 - PID_WORDS);
 
 #define HZ 100                  // timer interrupt frequency (interrupts/sec)
 static std::atomic<unsigned long> ticks; // # timer interrupts so far
 
+#define MEMSHOW_INTERVAL 4      // redraw memviewer at most every 4 ticks
+                                // (headless: log a summary every second)
+
+// Boot timing: the TSC counts cycles since the machine was reset, so its
+// value on entry to `kernel_start` measures firmware plus boot loader
+// time. The timer calibrates the TSC rate after one second.
+static uint64_t boot_tsc;       // `rdtsc()` on entry to `kernel_start`
+static uint64_t timer_tsc;      // `rdtsc()` when the timer started
+
+// Sleeping processes, hashed by `wakeup_tick % TIMER_WHEEL_SIZE` and
+// linked through `proc::wait_next`
+#define TIMER_WHEEL_SIZE 32
+static proc* timer_wheel[TIMER_WHEEL_SIZE];
+static spinlock timer_lock;     // protects `timer_wheel`
+
 
 // Memory state - see `kernel.hh`
 physpageinfo physpages[NPAGES];
+spinlock page_lock;
 
 
 [[noreturn]] void schedule();
@@ -47,20 +73,27 @@ void memshow();
 //    Initialize the hardware and processes and start running. The `command`
 //    string is an optional string passed from the boot loader.
 
-static void process_setup(pid_t pid, const char* program_name);
+static void process_setup(const char* program_name);
 
 void kernel_start(const char* command) {
+    boot_tsc = rdtsc();
+
     // initialize hardware
     init_hardware();
     log_printf("Starting WeensyOS\n");
 
     ticks = 1;
     init_timer(HZ);
+    timer_tsc = rdtsc();
 
     // clear screen
     console_clear();
 
     // (re-)initialize kernel page table
+    // Physical memory holds the null page and user-accessible process
+    // pages, so it needs 4 KiB pages. Kernel-only regions, such as
+    // memory-mapped I/O and the symbol table, use large pages instead
+    // (see `vmiter::map_large`).
     for (uintptr_t addr = 0; addr < MEMSIZE_PHYSICAL; addr += PAGESIZE) {
         int perm = PTE_P | PTE_W | PTE_U;
         if (addr == 0) {
@@ -73,25 +106,45 @@ void kernel_start(const char* command) {
                         // (Note that later mappings might fail!!)
     }
 
-    // set up process descriptors
-    for (pid_t i = 0; i < PID_MAX; i++) {
-        ptable[i].pid = i;
-        ptable[i].state = P_FREE;
-    }
+    // set up processes (pids are allocated in order, starting at 1)
     if (!command) {
         command = WEENSYOS_FIRST_PROCESS;
     }
-    if (!program_image(command).empty()) {
-        process_setup(1, command);
+    if (strcmp(command, "top") == 0) {
+        // `p-top` takes allocator 4's place and watches the others
+        process_setup("allocator");
+        process_setup("allocator2");
+        process_setup("allocator3");
+        process_setup("top");
+    } else if (strcmp(command, "bench") == 0) {
+        // `p-bench2`, the same program at allocator 2's address, is
+        // `p-bench`'s partner
+        process_setup("bench");
+        process_setup("bench2");
+    } else if (!program_image(command).empty()) {
+        process_setup(command);
     } else {
-        process_setup(1, "allocator");
-        process_setup(2, "allocator2");
-        process_setup(3, "allocator3");
-        process_setup(4, "allocator4");
+        process_setup("allocator");
+        process_setup("allocator2");
+        process_setup("allocator3");
+        process_setup("allocator4");
     }
 
-    // switch to first process using run()
-    run(&ptable[1]);
+    // start the other CPUs; they steal processes from CPU 0's run queue
+    boot_aps();
+
+    // switch to first process using schedule()
+    schedule();
+}
+
+
+// kernel_ap_start()
+//    Entry point for the other CPUs (application processors). Starts the
+//    CPU's timer and runs processes.
+
+void kernel_ap_start() {
+    init_timer(HZ);
+    schedule();
 }
 
 
@@ -132,41 +185,166 @@ void* kalloc(size_t sz) {
     // The easiest way to do this is to set page_increment to 3, but you can
     // also set `pageno` randomly.
 
-    for (int tries = 0; tries != NPAGES; ++tries) {
-        uintptr_t pa = pageno * PAGESIZE;
-        if (allocatable_physical_address(pa)
-            && physpages[pageno].refcount == 0) {
+    // The first pass skips pre-zeroed pages, saving them for `kzalloc`.
+    // If every page is in use, reclaim cached or clean pages and retry.
+    uintptr_t pa = 0;
+    do {
+        page_lock.lock();
+        for (int tries = 0; tries != 2 * NPAGES; ++tries) {
+            if (allocatable_physical_address(pageno * PAGESIZE)
+                && physpages[pageno].refcount == 0
+                && (!physpages[pageno].zeroed || tries >= int(NPAGES))) {
+                ++physpages[pageno].refcount;
+                physpages[pageno].zeroed = false;
+                pa = pageno * PAGESIZE;
+                break;
+            }
+            pageno = (pageno + page_increment) % NPAGES;
+        }
+        page_lock.unlock();
+    } while (!pa && reclaim_pages() != 0);
+
+    if (!pa) {
+        return nullptr;
+    }
+    trace(TRACE_PAGE_ALLOC, pa);
+    memviewer_mark_dirty(pa);
+    memset((void*) pa, 0xCC, PAGESIZE);
+    return (void*) pa;
+}
+
+
+// kzalloc(sz)
+//    Like `kalloc`, but the returned memory is filled with zeros. Pages
+//    come from a pool that idle CPUs zero ahead of time (see
+//    `refill_zeroed_pool`), so this usually skips the `memset`.
+
+#define ZEROED_POOL_SIZE 64
+static unsigned zeroed_pool[ZEROED_POOL_SIZE];  // page numbers; `page_lock`
+static int zeroed_pool_size;
+static int zeroed_pool_pending; // pages being zeroed for the pool
+static bool all_free_zeroed;    // true if no free page needs zeroing
+
+void* kzalloc(size_t sz) {
+    if (sz > PAGESIZE) {
+        return nullptr;
+    }
+
+    uintptr_t pa = 0;
+    page_lock.lock();
+    while (!pa && zeroed_pool_size > 0) {
+        // `kalloc` may have taken a pooled page; skip it if so
+        unsigned pageno = zeroed_pool[--zeroed_pool_size];
+        if (physpages[pageno].refcount == 0 && physpages[pageno].zeroed) {
             ++physpages[pageno].refcount;
-            memset((void*) pa, 0xCC, PAGESIZE);
-            return (void*) pa;
+            physpages[pageno].zeroed = false;
+            pa = pageno * PAGESIZE;
         }
-        pageno = (pageno + page_increment) % NPAGES;
     }
+    page_lock.unlock();
 
-    return nullptr;
+    if (pa) {
+        trace(TRACE_PAGE_ALLOC, pa);
+        memviewer_mark_dirty(pa);
+        return (void*) pa;
+    }
+    void* ptr = kalloc(sz);
+    if (ptr) {
+        memset(ptr, 0, PAGESIZE);
+    }
+    return ptr;
+}
+
+
+// refill_zeroed_pool()
+//    Zero one free page and add it to the pool. See `kernel.hh`.
+//    Every free page marked `zeroed` is in the pool: zeroing more pages
+//    than the pool holds would hide them from `kzalloc` and `kalloc`.
+
+bool refill_zeroed_pool() {
+    static unsigned cursor = 0;
+    page_lock.lock();
+    if (all_free_zeroed
+        || zeroed_pool_size + zeroed_pool_pending >= ZEROED_POOL_SIZE) {
+        page_lock.unlock();
+        return false;
+    }
+    for (int tries = 0; tries != NPAGES; ++tries) {
+        unsigned pageno = cursor;
+        cursor = (cursor + 1) % NPAGES;
+        if (allocatable_physical_address(pageno * PAGESIZE)
+            && physpages[pageno].refcount == 0
+            && !physpages[pageno].zeroed) {
+            // Reserve the page so `kalloc` skips it, and zero it without
+            // holding `page_lock`.
+            ++physpages[pageno].refcount;
+            ++zeroed_pool_pending;
+            page_lock.unlock();
+            memset((void*) (pageno * PAGESIZE), 0, PAGESIZE);
+
+            page_lock.lock();
+            --physpages[pageno].refcount;
+            --zeroed_pool_pending;
+            physpages[pageno].zeroed = true;
+            assert(zeroed_pool_size < ZEROED_POOL_SIZE);
+            zeroed_pool[zeroed_pool_size] = pageno;
+            ++zeroed_pool_size;
+            page_lock.unlock();
+            return true;
+        }
+    }
+    all_free_zeroed = true;
+    page_lock.unlock();
+    return false;
 }
 
 
 // kfree(kptr)
-//    Free `kptr`, which must have been previously returned by `kalloc`.
-//    If `kptr == nullptr` does nothing.
+//    Free `kptr`, which must have been previously returned by `kalloc`,
+//    `kzalloc`, or `kmalloc`. If `kptr == nullptr` does nothing.
 
 void kfree(void* kptr) {
-    (void) kptr;
-    assert(false /* your code here */);
+    if (!kptr) {
+        return;
+    }
+    uintptr_t pa = kptr2pa(kptr);
+    assert(pa < MEMSIZE_PHYSICAL);
+    if (physpages[pa / PAGESIZE].slab_class >= 0) {
+        slab_free(kptr);
+        return;
+    }
+    assert(pa % PAGESIZE == 0 && allocatable_physical_address(pa));
+    page_lock.lock();
+    assert(physpages[pa / PAGESIZE].refcount > 0);
+    --physpages[pa / PAGESIZE].refcount;
+    if (physpages[pa / PAGESIZE].refcount == 0) {
+        // its contents are garbage until an idle CPU zeroes it
+        all_free_zeroed = false;
+        physpages[pa / PAGESIZE].shared = false;
+        physpages[pa / PAGESIZE].kmalloced = false;
+        physpages[pa / PAGESIZE].owner = 0;
+    }
+    page_lock.unlock();
+    trace(TRACE_PAGE_FREE, pa);
+    memviewer_mark_dirty(pa);
 }
 
 
-// process_setup(pid, program_name)
-//    Load application program `program_name` as process number `pid`.
-//    This loads the application's code and data into memory, sets its
-//    %rip and %rsp, gives it a stack page, and marks it as runnable.
+// process_setup(program_name)
+//    Load application program `program_name` as a new process.
+//    This allocates a process descriptor, loads the application's code and
+//    data into memory, sets its %rip and %rsp, gives it a stack page, and
+//    marks it as runnable.
 
-void process_setup(pid_t pid, const char* program_name) {
-    init_process(&ptable[pid], 0);
+void process_setup(const char* program_name) {
+    proc* p = alloc_proc();
+    assert(p);
+    pid_t pid = p->pid;
+    init_process(p, 0);
+    p->program = program_image::program_number(program_name);
 
     // initialize process page table
-    ptable[pid].pagetable = kernel_pagetable;
+    p->pagetable = kernel_pagetable;
 
     // obtain reference to program image
     // (The program image models the process executable.)
@@ -180,8 +358,13 @@ void process_setup(pid_t pid, const char* program_name) {
             // `a` is the process virtual address for the next code/data page
             // (The handout code requires that the corresponding physical
             // address is currently free.)
+            page_lock.lock();
             assert(physpages[a / PAGESIZE].refcount == 0);
             ++physpages[a / PAGESIZE].refcount;
+            physpages[a / PAGESIZE].zeroed = false;
+            physpages[a / PAGESIZE].owner = pid;
+            page_lock.unlock();
+            memviewer_mark_dirty(a);
         }
     }
 
@@ -192,22 +375,149 @@ void process_setup(pid_t pid, const char* program_name) {
     }
 
     // mark entry point
-    ptable[pid].regs.reg_rip = pgm.entry();
+    p->regs.reg_rip = pgm.entry();
 
     // allocate and map stack segment
     // Compute process virtual address for stack page
     uintptr_t stack_addr = PROC_START_ADDR + PROC_SIZE * pid - PAGESIZE;
     // The handout code requires that the corresponding physical address
     // is currently free.
+    page_lock.lock();
     assert(physpages[stack_addr / PAGESIZE].refcount == 0);
     ++physpages[stack_addr / PAGESIZE].refcount;
-    ptable[pid].regs.reg_rsp = stack_addr + PAGESIZE;
+    physpages[stack_addr / PAGESIZE].zeroed = false;
+    physpages[stack_addr / PAGESIZE].owner = pid;
+    page_lock.unlock();
+    memviewer_mark_dirty(stack_addr);
+    p->regs.reg_rsp = stack_addr + PAGESIZE;
 
     // mark process as runnable
-    ptable[pid].state = P_RUNNABLE;
+    p->state = P_RUNNABLE;
+    this_cpu()->enqueue(p);
 }
 
 
+// alloc_proc(), free_proc(p), next_pid(pid)
+//    Process descriptor and pid management; see kernel.hh.
+
+static void shm_release(proc* p);
+
+proc* alloc_proc() {
+    void* ptr = kmalloc(sizeof(proc));
+    if (!ptr) {
+        return nullptr;
+    }
+    ptable_lock.lock();
+    if (!pid_avail) {
+        ptable_lock.unlock();
+        kfree(ptr);
+        return nullptr;
+    }
+    int w = lsb(pid_avail) - 1;
+    int b = lsb(~pid_used[w]) - 1;
+    pid_used[w] |= uint64_t(1) << b;
+    if (pid_used[w] == ~uint64_t(0)) {
+        pid_avail &= ~(uint64_t(1) << w);
+    }
+    proc* p = new (ptr) proc();
+    p->pid = w * 64 + b;
+    p->state = P_FREE;
+    ptable[p->pid] = p;
+    ptable_lock.unlock();
+    return p;
+}
+
+void free_proc(proc* p) {
+    pid_t pid = p->pid;
+    if (p->pagetable) {
+        vma_release(p);
+    }
+    if (p->pagetable && p->pagetable != kernel_pagetable) {
+        // Free a private page table with the process: first the pages it
+        // maps for the process, then the page table pages. No CPU has it
+        // loaded, and `free_pagetable` flushes its PCID before the pages
+        // can be reused.
+        for (vmiter it(p, PROC_START_ADDR);
+             it.va() < MEMSIZE_VIRTUAL;
+             it.next()) {
+            if (it.user()) {
+                kfree(it.kptr());
+            }
+        }
+        free_pagetable(p->pagetable);
+    } else if (p->pagetable) {
+        shm_release(p);
+        // `kernel_pagetable` keeps mapping the process's pages, so find
+        // them by owner. Shared memory pages may outlive their creator.
+        for (uintptr_t pa = 0; pa != MEMSIZE_PHYSICAL; pa += PAGESIZE) {
+            page_lock.lock();
+            bool owned = physpages[pa / PAGESIZE].owner == pid
+                && physpages[pa / PAGESIZE].refcount > 0
+                && !physpages[pa / PAGESIZE].shared;
+            page_lock.unlock();
+            if (owned) {
+                kfree(pa2kptr<void*>(pa));
+            }
+        }
+    }
+    ptable_lock.lock();
+    assert(ptable[pid] == p);
+    ptable[pid] = nullptr;
+    pid_used[pid / 64] &= ~(uint64_t(1) << (pid % 64));
+    pid_avail |= uint64_t(1) << (pid / 64);
+    ptable_lock.unlock();
+    kfree(p);
+}
+
+pid_t next_pid(pid_t pid) {
+    ++pid;
+    for (int w = pid / 64; w < PID_WORDS; ++w) {
+        uint64_t bits = pid_used[w];
+        if (w == pid / 64) {
+            bits &= ~uint64_t(0) << (pid % 64);
+        }
+        if (bits) {
+            return w * 64 + lsb(bits) - 1;
+        }
+    }
+    return 0;
+}
+
+
+
+// timer_interrupt(regs)
+//    Handle a timer interrupt that arrived with registers `regs`. CPU 0
+//    advances `ticks` and wakes the sleeping processes whose time has
+//    come; it only needs to check one `timer_wheel` bucket per tick.
+
+static void timer_interrupt(const regstate* regs) {
+    if (this_cpu()->index_ == 0) {
+        unsigned long now = ++ticks;
+        if (now == HZ + 1) {
+            uint64_t tsc_per_ms = (rdtsc() - timer_tsc) / 1000;
+            log_printf("Boot: kernel_start reached %lu ms after reset "
+                       "(TSC %lu, %lu cycles/ms)\n",
+                       boot_tsc / tsc_per_ms, boot_tsc, tsc_per_ms);
+        }
+        spinlock_guard guard(timer_lock);
+        proc** pp = &timer_wheel[now % TIMER_WHEEL_SIZE];
+        while (proc* p = *pp) {
+            if (long(now - p->wakeup_tick) >= 0) {
+                *pp = p->wait_next;
+                wake(p);
+            } else {
+                pp = &p->wait_next;
+            }
+        }
+    }
+    trace(TRACE_TIMER, ticks);
+    if (proc* p = current()) {
+        ++p->stats.ticks;
+    }
+    profile_sample(regs);
+    lapicstate::get().ack();
+}
+
 
 // exception(regs)
 //    Exception handler (for interrupts, traps, and faults).
@@ -218,23 +528,43 @@ void process_setup(pid_t pid, const char* program_name) {
 //    k-exception.S). That code saves more registers on the kernel's stack,
 //    then calls exception().
 //
-//    Note that hardware interrupts are disabled when the kernel is running.
+//    Note that hardware interrupts are disabled when the kernel is running,
+//    except while a CPU is idle in `schedule()`.
 
 void exception(regstate* regs) {
+    // This CPU no longer uses user-mode TLB entries (see `invalidate_tlb`).
+    this_cpu()->in_user_ = false;
+
+    // An interrupt that arrives while this CPU idles in `schedule()` has
+    // no current process. Handle it and return to the idle loop.
+    if (!current()) {
+        if (regs->reg_intno == INT_IRQ + IRQ_TLB) {
+            lapicstate::get().ack();
+        } else if (regs->reg_intno == INT_IRQ + IRQ_TIMER) {
+            timer_interrupt(regs);
+        } else {
+            panic("Unexpected exception %d in idle loop (rip=%p)!\n",
+                  regs->reg_intno, regs->reg_rip);
+        }
+        return;
+    }
+
     // Copy the saved registers into the `current` process descriptor.
-    current->regs = *regs;
-    regs = &current->regs;
+    current()->regs = *regs;
+    regs = &current()->regs;
 
     // It can be useful to log events using `log_printf`.
     // Events logged this way are stored in the host's `log.txt` file.
     /* log_printf("proc %d: exception %d at rip %p\n",
-                current->pid, regs->reg_intno, regs->reg_rip); */
+                current()->pid, regs->reg_intno, regs->reg_rip); */
 
     // Show the current cursor location and memory state
-    // (unless this is a kernel fault).
-    console_show_cursor(cursorpos);
-    if (regs->reg_intno != INT_PF || (regs->reg_errcode & PTE_U)) {
-        memshow();
+    // (unless this is a kernel fault). Only CPU 0 draws the console.
+    if (this_cpu()->index_ == 0) {
+        console_show_cursor(cursorpos);
+        if (regs->reg_intno != INT_PF || (regs->reg_errcode & PTE_U)) {
+            memshow();
+        }
     }
 
     // If Control-C was typed, exit the virtual machine.
@@ -245,11 +575,15 @@ void exception(regstate* regs) {
     switch (regs->reg_intno) {
 
     case INT_IRQ + IRQ_TIMER:
-        ++ticks;
-        lapicstate::get().ack();
+        timer_interrupt(regs);
         schedule();
         break;                  /* will not be reached */
 
+    case INT_IRQ + IRQ_TLB:
+        // `invalidate_tlb` on another CPU; `process_cr3` will flush
+        lapicstate::get().ack();
+        break;
+
     case INT_PF: {
         // Analyze faulting address and access type.
         uintptr_t addr = rdcr2();
@@ -257,29 +591,37 @@ void exception(regstate* regs) {
                 ? "write" : "read";
         const char* problem = regs->reg_errcode & PTE_P
                 ? "protection problem" : "missing page";
+        trace(TRACE_FAULT, addr, regs->reg_errcode);
 
         if (!(regs->reg_errcode & PTE_U)) {
-            proc_panic(current, "Kernel page fault on %p (%s %s, rip=%p)!\n",
+            proc_panic(current(), "Kernel page fault on %p (%s %s, rip=%p)!\n",
                        addr, operation, problem, regs->reg_rip);
         }
+        ++current()->stats.nfaults;
+        if (!(regs->reg_errcode & PTE_P)
+            && (vma_fault(current(), addr)
+                || reload_text(current(), addr))) {
+            break;
+        }
         error_printf(CPOS(24, 0), COLOR_ERROR,
                      "PAGE FAULT on %p (pid %d, %s %s, rip=%p)!\n",
-                     addr, current->pid, operation, problem, regs->reg_rip);
-        log_print_backtrace(current);
-        current->state = P_FAULTED;
+                     addr, current()->pid, operation, problem, regs->reg_rip);
+        log_print_backtrace(current());
+        current()->state = P_FAULTED;
         break;
     }
 
     default:
-        proc_panic(current, "Unhandled exception %d (rip=%p)!\n",
+        trace(TRACE_EXCEPTION, regs->reg_intno, regs->reg_rip);
+        proc_panic(current(), "Unhandled exception %d (rip=%p)!\n",
                    regs->reg_intno, regs->reg_rip);
 
     }
 
 
     // Return to the current process (or run something else).
-    if (current->state == P_RUNNABLE) {
-        run(current);
+    if (current()->state == P_RUNNABLE) {
+        run(current());
     } else {
         schedule();
     }
@@ -287,6 +629,13 @@ void exception(regstate* regs) {
 
 
 int syscall_page_alloc(uintptr_t addr);
+[[noreturn]] void syscall_exit();
+int syscall_sleep(unsigned long nticks);
+int syscall_shm_create(uintptr_t addr);
+int syscall_shm_attach(uintptr_t id, uintptr_t addr);
+ssize_t syscall_write(uintptr_t addr, size_t sz);
+int syscall_getstats(pid_t pid, uintptr_t addr);
+ssize_t syscall_log(uintptr_t addr, size_t sz);
 
 
 // syscall(regs)
@@ -298,26 +647,37 @@ int syscall_page_alloc(uintptr_t addr);
 //    resume with `V` stored in `%rax` (so the system call effectively
 //    returns `V`). Alternately, the kernel can exit this function by
 //    calling `schedule()`, perhaps after storing the eventual system call
-//    return value in `current->regs.reg_rax`.
+//    return value in `current()->regs.reg_rax`.
 //
 //    It is only valid to return from this function if
-//    `current->state == P_RUNNABLE`.
+//    `current()->state == P_RUNNABLE`.
 //
 //    Note that hardware interrupts are disabled when the kernel is running.
 
 uintptr_t syscall(regstate* regs) {
+    // This CPU no longer uses user-mode TLB entries (see `invalidate_tlb`).
+    this_cpu()->in_user_ = false;
+
     // Copy the saved registers into the `current` process descriptor.
-    current->regs = *regs;
-    regs = &current->regs;
+    current()->regs = *regs;
+    regs = &current()->regs;
 
     // It can be useful to log events using `log_printf`.
     // Events logged this way are stored in the host's `log.txt` file.
     /* log_printf("proc %d: syscall %d at rip %p\n",
-                  current->pid, regs->reg_rax, regs->reg_rip); */
+                  current()->pid, regs->reg_rax, regs->reg_rip); */
+    // `trace` is much cheaper and always on; see `k-trace.hh`.
+    trace(TRACE_SYSCALL, regs->reg_rax, regs->reg_rdi);
+    if (regs->reg_rax < NSYSCALLS) {
+        ++current()->stats.nsyscalls[regs->reg_rax];
+    }
 
     // Show the current cursor location and memory state.
-    console_show_cursor(cursorpos);
-    memshow();
+    // Only CPU 0 draws the console.
+    if (this_cpu()->index_ == 0) {
+        console_show_cursor(cursorpos);
+        memshow();
+    }
 
     // If Control-C was typed, exit the virtual machine.
     check_keyboard();
@@ -327,22 +687,74 @@ uintptr_t syscall(regstate* regs) {
     switch (regs->reg_rax) {
 
     case SYSCALL_PANIC:
-        user_panic(current);
+        user_panic(current());
         break; // will not be reached
 
     case SYSCALL_GETPID:
-        return current->pid;
+        return current()->pid;
 
     case SYSCALL_YIELD:
-        current->regs.reg_rax = 0;
+        current()->regs.reg_rax = 0;
         schedule();             // does not return
 
     case SYSCALL_PAGE_ALLOC:
-        return syscall_page_alloc(current->regs.reg_rdi);
+        return syscall_page_alloc(current()->regs.reg_rdi);
+
+    case SYSCALL_EXIT:
+        syscall_exit();         // does not return
+
+    case SYSCALL_SLEEP:
+        return syscall_sleep(current()->regs.reg_rdi);
+
+    case SYSCALL_SHM_CREATE:
+        return syscall_shm_create(current()->regs.reg_rdi);
+
+    case SYSCALL_SHM_ATTACH:
+        return syscall_shm_attach(current()->regs.reg_rdi,
+                                  current()->regs.reg_rsi);
+
+    case SYSCALL_PIPE:
+        return syscall_pipe();
+
+    case SYSCALL_PIPE_READ:
+        return syscall_pipe_read(current()->regs.reg_rdi,
+                                 current()->regs.reg_rsi,
+                                 current()->regs.reg_rdx);
+
+    case SYSCALL_PIPE_WRITE:
+        return syscall_pipe_write(current()->regs.reg_rdi,
+                                  current()->regs.reg_rsi,
+                                  current()->regs.reg_rdx);
+
+    case SYSCALL_PIPE_CLOSE:
+        return syscall_pipe_close(current()->regs.reg_rdi);
+
+    case SYSCALL_GETTICKS:
+        return ticks;
+
+    case SYSCALL_WRITE:
+        return syscall_write(current()->regs.reg_rdi,
+                             current()->regs.reg_rsi);
+
+    case SYSCALL_GETSTATS:
+        return syscall_getstats(current()->regs.reg_rdi,
+                                current()->regs.reg_rsi);
+
+    case SYSCALL_MMAP:
+        return syscall_mmap(current()->regs.reg_rdi,
+                            current()->regs.reg_rsi);
+
+    case SYSCALL_MUNMAP:
+        return syscall_munmap(current()->regs.reg_rdi,
+                              current()->regs.reg_rsi);
+
+    case SYSCALL_LOG:
+        return syscall_log(current()->regs.reg_rdi,
+                           current()->regs.reg_rsi);
 
     default:
-        proc_panic(current, "Unhandled system call %ld (pid=%d, rip=%p)!\n",
-                   regs->reg_rax, current->pid, regs->reg_rip);
+        proc_panic(current(), "Unhandled system call %ld (pid=%d, rip=%p)!\n",
+                   regs->reg_rax, current()->pid, regs->reg_rip);
 
     }
 
@@ -356,43 +768,393 @@ uintptr_t syscall(regstate* regs) {
 //    in `u-lib.hh` (but in the handout code, it does not).
 
 int syscall_page_alloc(uintptr_t addr) {
-    assert(physpages[addr / PAGESIZE].refcount == 0);
+    page_lock.lock();
+    if (physpages[addr / PAGESIZE].refcount != 0) {
+        // Reclaim could only free unrelated pages; this one is in use.
+        page_lock.unlock();
+        return E_NOMEM;
+    }
     ++physpages[addr / PAGESIZE].refcount;
-    memset((void*) addr, 0, PAGESIZE);
+    // idle CPUs have usually zeroed the page already
+    bool zeroed = physpages[addr / PAGESIZE].zeroed;
+    physpages[addr / PAGESIZE].zeroed = false;
+    physpages[addr / PAGESIZE].owner = current()->pid;
+    page_lock.unlock();
+    trace(TRACE_PAGE_ALLOC, addr);
+    memviewer_mark_dirty(addr);
+    if (!zeroed) {
+        memset((void*) addr, 0, PAGESIZE);
+    }
     return 0;
 }
 
 
+// syscall_exit()
+//    Handles the SYSCALL_EXIT system call: frees the current process and
+//    its memory (`free_proc`), then runs something else. This CPU is on
+//    its own kernel stack, not the process's, so the descriptor can be
+//    freed here.
+
+void syscall_exit() {
+    cpustate* c = this_cpu();
+    proc* p = c->current_;
+    // Give up `p` first, so `schedule()` won't requeue it.
+    p->state = P_FREE;
+    c->current_ = nullptr;
+    free_proc(p);
+    schedule();
+}
+
+
+// syscall_sleep(nticks)
+//    Handles the SYSCALL_SLEEP system call: blocks the current process on
+//    the timer wheel for `nticks` ticks.
+
+int syscall_sleep(unsigned long nticks) {
+    if (nticks == 0) {
+        return 0;
+    }
+    proc* p = current();
+    p->regs.reg_rax = 0;
+    timer_lock.lock();
+    p->wakeup_tick = ticks + nticks;
+    block_current(timer_wheel[p->wakeup_tick % TIMER_WHEEL_SIZE], timer_lock);
+}
+
+
+// syscall_write(addr, sz)
+//    Handles the SYSCALL_WRITE system call: prints `sz` bytes at `addr`
+//    to the console at the cursor, a page of user memory at a time.
+
+ssize_t syscall_write(uintptr_t addr, size_t sz) {
+    proc* p = current();
+    if (!vma_populate(p, addr, sz)
+        || !vmiter(p, addr).range_perm(sz, PTE_P | PTE_U)) {
+        return E_INVAL;
+    }
+    static spinlock console_lock;       // serializes writers' cursor updates
+    spinlock_guard guard(console_lock);
+    console_printer cp(-1, true);
+    for (vmiter it(p, addr); it.va() != addr + sz; ) {
+        size_t n = min(addr + sz - it.va(), PAGESIZE - it.va() % PAGESIZE);
+        const char* s = it.kptr<const char*>();
+        for (size_t i = 0; i != n; ++i) {
+            cp.putc(s[i]);
+        }
+        it += n;
+    }
+    cp.move_cursor();
+    return sz;
+}
+
+
+// syscall_log(addr, sz)
+//    Handles the SYSCALL_LOG system call: appends `sz` bytes at `addr` to
+//    the host's `log.txt`.
+
+ssize_t syscall_log(uintptr_t addr, size_t sz) {
+    proc* p = current();
+    if (!vma_populate(p, addr, sz)
+        || !vmiter(p, addr).range_perm(sz, PTE_P | PTE_U)) {
+        return E_INVAL;
+    }
+    for (vmiter it(p, addr); it.va() != addr + sz; ) {
+        size_t n = min(addr + sz - it.va(), PAGESIZE - it.va() % PAGESIZE);
+        log_printf("%.*s", int(n), it.kptr<const char*>());
+        it += n;
+    }
+    return sz;
+}
+
+
+// syscall_getstats(pid, addr)
+//    Handles the SYSCALL_GETSTATS system call: copies process `pid`'s
+//    `proc_stats` to `addr`. Counters of a running process may be a tick
+//    out of date.
+
+int syscall_getstats(pid_t pid, uintptr_t addr) {
+    proc* p = current();
+    if (!vma_populate(p, addr, sizeof(proc_stats))
+        || !vmiter(p, addr).range_perm(sizeof(proc_stats),
+                                       PTE_P | PTE_W | PTE_U)) {
+        return E_INVAL;
+    }
+    spinlock_guard guard(ptable_lock);
+    proc* q = pid > 0 && pid < PID_MAX ? ptable[pid] : nullptr;
+    if (!q) {
+        return E_INVAL;
+    }
+    proc_stats st = q->stats;
+    st.npages = 0;
+    page_lock.lock();
+    for (int pn = 0; pn != NPAGES; ++pn) {
+        st.npages += physpages[pn].owner == pid;
+    }
+    page_lock.unlock();
+    vmcopy(p->pagetable, addr, kernel_pagetable, kptr2pa(&st), sizeof(st));
+    return 0;
+}
+
+
+// block_current(wait_list, lock), wake(p), wake_all(wait_list)
+//    Block and unblock processes. See `kernel.hh`.
+
+void block_current(proc*& wait_list, spinlock& lock) {
+    cpustate* c = this_cpu();
+    proc* p = c->current_;
+    p->state = P_BLOCKED;
+    // Give up `p` before another CPU can wake it, so `schedule()` won't
+    // requeue it.
+    c->current_ = nullptr;
+    p->wait_next = wait_list;
+    wait_list = p;
+    lock.unlock();
+    schedule();
+}
+
+void wake(proc* p) {
+    assert(p->state == P_BLOCKED);
+    p->state = P_RUNNABLE;
+    this_cpu()->enqueue(p);
+}
+
+void wake_all(proc*& wait_list) {
+    while (proc* p = wait_list) {
+        wait_list = p->wait_next;
+        wake(p);
+    }
+}
+
+
+// syscall_shm_create(addr), syscall_shm_attach(id, addr), shm_release(p)
+//    Handle the SYSCALL_SHM_CREATE and SYSCALL_SHM_ATTACH system calls.
+//    A shared page's ID is its physical page number.
+//
+//    With private page tables, each mapping holds one `physpages`
+//    reference, so the page is freed by the `kfree` that drops the last
+//    mapping, like any other process page.
+//
+//    Processes that share `kernel_pagetable`, as in the handout code,
+//    share one mapping too: a shared page appears in every process at the
+//    address where it was created, and is attached only there. Instead of
+//    the mapping, each process using the page holds one reference, marked
+//    in `proc::shm_refs`. When the last one exits, `shm_release` unmaps
+//    the page and frees it.
+
+static bool shm_addr_ok(proc* p, uintptr_t addr) {
+    if (addr % PAGESIZE != 0
+        || addr < PROC_START_ADDR
+        || addr >= MEMSIZE_VIRTUAL) {
+        return false;
+    }
+    // Processes that share `kernel_pagetable` must not replace the
+    // kernel's identity mapping.
+    return p->pagetable != kernel_pagetable || addr >= MEMSIZE_PHYSICAL;
+}
+
+int syscall_shm_create(uintptr_t addr) {
+    proc* p = current();
+    if (!shm_addr_ok(p, addr) || vmiter(p, addr).present()) {
+        return E_INVAL;
+    }
+    void* kptr = kzalloc(PAGESIZE);
+    if (!kptr) {
+        return E_NOMEM;
+    }
+    if (vmiter(p, addr).try_map(kptr, PTE_P | PTE_W | PTE_U) < 0) {
+        kfree(kptr);
+        return E_NOMEM;
+    }
+    uintptr_t id = kptr2pa(kptr) / PAGESIZE;
+    if (p->pagetable == kernel_pagetable) {
+        p->shm_refs[id / 64] |= uint64_t(1) << (id % 64);
+    }
+    spinlock_guard guard(page_lock);
+    physpages[id].shared = true;
+    physpages[id].owner = p->pid;
+    return id;
+}
+
+int syscall_shm_attach(uintptr_t id, uintptr_t addr) {
+    proc* p = current();
+    if (id >= NPAGES || !shm_addr_ok(p, addr)) {
+        return E_INVAL;
+    }
+    if (p->pagetable == kernel_pagetable) {
+        vmiter it(p, addr);
+        if (!it.user() || it.pa() != id * PAGESIZE) {
+            return E_INVAL;
+        }
+        spinlock_guard guard(page_lock);
+        if (!physpages[id].shared) {
+            return E_INVAL;
+        }
+        uint64_t bit = uint64_t(1) << (id % 64);
+        if (!(p->shm_refs[id / 64] & bit)) {
+            ++physpages[id].refcount;
+            p->shm_refs[id / 64] |= bit;
+        }
+        return 0;
+    }
+
+    if (vmiter(p, addr).present()) {
+        return E_INVAL;
+    }
+    page_lock.lock();
+    if (!physpages[id].shared) {
+        page_lock.unlock();
+        return E_INVAL;
+    }
+    if (physpages[id].refcount >= PID_MAX) {
+        page_lock.unlock();
+        return E_RANGE;
+    }
+    ++physpages[id].refcount;
+    page_lock.unlock();
+
+    if (vmiter(p, addr).try_map(id * PAGESIZE, PTE_P | PTE_W | PTE_U) < 0) {
+        kfree(pa2kptr<void*>(id * PAGESIZE));
+        return E_NOMEM;
+    }
+    memviewer_mark_dirty(id * PAGESIZE);
+    return 0;
+}
+
+static void shm_release(proc* p) {
+    for (int w = 0; w != NPAGES / 64; ++w) {
+        while (uint64_t bits = p->shm_refs[w]) {
+            uintptr_t id = w * 64 + lsb(bits) - 1;
+            p->shm_refs[w] = bits & (bits - 1);
+            page_lock.lock();
+            bool last = physpages[id].refcount == 1;
+            if (last) {
+                // stop new attaches before unlocking
+                physpages[id].shared = false;
+            } else {
+                --physpages[id].refcount;
+                if (physpages[id].owner == p->pid) {
+                    physpages[id].owner = 0;
+                }
+            }
+            page_lock.unlock();
+            if (last) {
+                for (vmiter it(kernel_pagetable, MEMSIZE_PHYSICAL);
+                     it.va() < MEMSIZE_VIRTUAL;
+                     it.next()) {
+                    if (it.user() && it.pa() == id * PAGESIZE) {
+                        it.unmap_noflush();
+                        break;
+                    }
+                }
+                invalidate_tlb(kernel_pagetable);
+                kfree(pa2kptr<void*>(id * PAGESIZE));
+            }
+        }
+    }
+}
+
+
 // schedule
 //    Pick the next process to run and then run it.
-//    If there are no runnable processes, spins forever.
+//    Each CPU has a FIFO run queue. If the current process is still
+//    runnable, it goes to the back of this CPU's queue. A CPU whose queue
+//    is empty steals a process from another CPU's queue. If there are no
+//    runnable processes, waits, zeroing free pages or halting until the
+//    next interrupt.
 
 void schedule() {
-    pid_t pid = current->pid;
-    for (unsigned spins = 1; true; ++spins) {
-        pid = (pid + 1) % PID_MAX;
-        if (ptable[pid].state == P_RUNNABLE) {
-            run(&ptable[pid]);
+    cpustate* c = this_cpu();
+    proc* prev = c->current_;
+    if (prev && prev->state == P_RUNNABLE) {
+        c->enqueue(prev);
+    }
+    c->current_ = nullptr;
+
+    while (true) {
+        proc* p = c->dequeue();
+        int from = c->index_;
+        for (int i = 1; !p && i != MAXCPU; ++i) {
+            from = (c->index_ + i) % MAXCPU;
+            p = cpu_state(from)->steal();
+        }
+        if (p) {
+            trace(TRACE_SCHEDULE, p->pid, from);
+            if (p != prev) {
+                ++p->stats.nswitches;
+            }
+            run(p);
         }
 
-        // If Control-C was typed, exit the virtual machine.
-        check_keyboard();
+        // Nothing to run: zero a free page for `kzalloc`.
+        bool busy = refill_zeroed_pool();
 
-        // If spinning forever, show the memviewer.
-        if (spins % (1 << 12) == 0) {
+        // CPU 0 also watches the keyboard and draws the memviewer.
+        if (c->index_ == 0) {
+            // If Control-C was typed, exit the virtual machine.
+            check_keyboard();
             memshow();
         }
+
+        // With no page to zero, halt until the next interrupt. This is
+        // the only place the kernel enables interrupts: the timer must
+        // keep ticking to wake sleeping processes. No locks are held.
+        if (!busy) {
+            asm volatile("sti; hlt; cli" : : : "memory");
+        }
     }
 }
 
 
+// cpustate::enqueue(p), cpustate::dequeue(), cpustate::steal()
+//    Run queue operations. A process is on at most one run queue, and never
+//    on a run queue while it is running.
+
+void cpustate::enqueue(proc* p) {
+    spinlock_guard guard(runq_lock_);
+    p->runq_next = nullptr;
+    if (runq_tail_) {
+        runq_tail_->runq_next = p;
+    } else {
+        runq_head_ = p;
+    }
+    runq_tail_ = p;
+}
+
+proc* cpustate::dequeue() {
+    spinlock_guard guard(runq_lock_);
+    proc* p = runq_head_;
+    if (p) {
+        runq_head_ = p->runq_next;
+        if (!runq_head_) {
+            runq_tail_ = nullptr;
+        }
+    }
+    return p;
+}
+
+proc* cpustate::steal() {
+    if (!runq_lock_.try_lock()) {
+        return nullptr;
+    }
+    proc* p = runq_head_;
+    if (p) {
+        runq_head_ = p->runq_next;
+        if (!runq_head_) {
+            runq_tail_ = nullptr;
+        }
+    }
+    runq_lock_.unlock();
+    return p;
+}
+
+
 // run(p)
-//    Run process `p`. This involves setting `current = p` and calling
-//    `exception_return` to restore its page table and registers.
+//    Run process `p`. This involves making `p` this CPU's current process
+//    and calling `exception_return` to restore its page table and registers.
 
 void run(proc* p) {
     assert(p->state == P_RUNNABLE);
-    current = p;
+    this_cpu()->current_ = p;
 
     // Check the process's current registers.
     check_process_registers(p);
@@ -410,30 +1172,96 @@ void run(proc* p) {
 }
 
 
+#if WEENSYOS_HEADLESS
+// memshow()
+//    Headless version: write a one-line memory summary to `log.txt` every
+//    second, listing free pages, page table pages, and the pages each
+//    process owns, as in `mem: tick 300 free 211 pt 5 pid 1 34 pid 2 30`.
+//    The counts are a snapshot and may race with concurrent allocation.
+
+void memshow() {
+    static unsigned long last_log_ticks = 0;
+    if (ticks - last_log_ticks < HZ) {
+        return;
+    }
+    last_log_ticks = ticks;
+
+    unsigned long nfree = 0;
+    for (uintptr_t pa = 0; pa != MEMSIZE_PHYSICAL; pa += PAGESIZE) {
+        if (allocatable_physical_address(pa)
+            && physpages[pa / PAGESIZE].refcount == 0) {
+            ++nfree;
+        }
+    }
+
+    spinlock_guard guard(ptable_lock);
+    // Processes sharing `kernel_pagetable` count it once.
+    auto count_pt = [] (x86_64_pagetable* pt) {
+        unsigned long n = 1;            // `ptiter` skips the root
+        for (ptiter it(pt); !it.done(); it.next()) {
+            ++n;
+        }
+        return n;
+    };
+    unsigned long npt = count_pt(kernel_pagetable);
+    for (pid_t pid = next_pid(0); pid; pid = next_pid(pid)) {
+        x86_64_pagetable* pt = ptable[pid]->pagetable;
+        if (pt && pt != kernel_pagetable) {
+            npt += count_pt(pt);
+        }
+    }
+    log_printf("mem: tick %lu free %lu pt %lu",
+               (unsigned long) ticks, nfree, npt);
+
+    for (pid_t pid = next_pid(0); pid; pid = next_pid(pid)) {
+        unsigned long npages = 0;
+        for (size_t pn = 0; pn != NPAGES; ++pn) {
+            if (physpages[pn].refcount != 0 && physpages[pn].owner == pid) {
+                ++npages;
+            }
+        }
+        log_printf(" pid %d %lu", pid, npages);
+    }
+    log_printf("\n");
+}
+#else
 // memshow()
 //    Draw a picture of memory (physical and virtual) on the CGA console.
 //    Switches to a new process's virtual memory map every 0.25 sec.
 //    Uses `console_memviewer()`, a function defined in `k-memviewer.cc`.
+//
+//    `memshow` runs on every kernel entry, so it redraws at most once
+//    every MEMSHOW_INTERVAL ticks.
 
 void memshow() {
     static unsigned last_ticks = 0;
-    static int showing = 0;
+    static unsigned last_draw_ticks = 0;
+    static pid_t showing = 0;
+
+    if (last_draw_ticks != 0
+        && ticks - last_draw_ticks < MEMSHOW_INTERVAL) {
+        return;
+    }
+    last_draw_ticks = ticks;
 
     // switch to a new process every 0.25 sec
-    if (last_ticks == 0 || ticks - last_ticks >= HZ / 2) {
+    bool advance = last_ticks == 0 || ticks - last_ticks >= HZ / 2;
+    if (advance) {
         last_ticks = ticks;
-        showing = (showing + 1) % PID_MAX;
     }
 
-    proc* p = nullptr;
-    for (int search = 0; !p && search < PID_MAX; ++search) {
-        if (ptable[showing].state != P_FREE
-            && ptable[showing].pagetable) {
-            p = &ptable[showing];
-        } else {
-            showing = (showing + 1) % PID_MAX;
-        }
+    // Find the next process with a page table, visiting only allocated
+    // pids. The sequence `next_pid` visits wraps through 0.
+    spinlock_guard guard(ptable_lock);
+    pid_t pid = ptable[showing] ? showing : 0;
+    if (advance || !pid || !ptable[pid]->pagetable) {
+        pid_t start = pid;
+        do {
+            pid = next_pid(pid);
+        } while (pid != start && !(pid && ptable[pid]->pagetable));
     }
+    showing = pid;
+    proc* p = pid && ptable[pid]->pagetable ? ptable[pid] : nullptr;
 
     console_memviewer(p);
     if (!p) {
@@ -442,3 +1270,4 @@ void memshow() {
             "\n\n\n\n\n\n\n\n\n\n\n");
     }
 }
+#endif
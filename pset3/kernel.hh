@@ -2,12 +2,14 @@
 #define WEENSYOS_KERNEL_HH
 #include "x86-64.h"
 #include "lib.hh"
+#include "k-lock.hh"
 #if WEENSYOS_PROCESS
 #error "kernel.hh should not be used by process code."
 #endif
 struct elf_header;
 struct elf_program;
 struct program_image_segment;
+struct vma;
 class vmiter;
 
 
@@ -29,10 +31,104 @@ struct proc {
     int state;                          // process state (see above)
     regstate regs;                      // process's current registers
     // The first 4 members of `proc` must not change, but you can add more.
+
+    proc* runq_next;                    // next process in CPU run queue
+    proc* wait_next;                    // next process in wait list
+    unsigned long wakeup_tick;          // when a sleeping process wakes
+
+    proc_stats stats;                   // resource accounting; `npages`
+                                        // is computed from `physpages`
+    int program = -1;                   // `program_image` number, used to
+                                        // reload dropped text pages
+    vma* vmas;                          // `sys_mmap` regions, by address
+    uint64_t shm_refs[8];               // shared pages held on
+                                        // `kernel_pagetable`, one bit per
+                                        // page number
 };
 
 // Process table
-extern proc ptable[PID_MAX];
+//    `ptable[pid]` points to process `pid`'s descriptor, or is `nullptr` if
+//    `pid` is free. Descriptors are allocated on demand by `alloc_proc`.
+extern proc* ptable[PID_MAX];
+// `ptable_lock` protects `ptable` and pid allocation (e.g., in fork).
+extern spinlock ptable_lock;
+
+// alloc_proc()
+//    Allocate the lowest free pid and a zeroed descriptor for it (state
+//    P_FREE), and install it in `ptable`. Returns `nullptr` if no pid or
+//    memory is available. Takes `ptable_lock`.
+proc* alloc_proc();
+
+// free_proc(p)
+//    Remove `p` from `ptable`, release its pid, and free its descriptor.
+//    Frees `p`'s memory-mapped regions (`vma_release`). If `p` has a
+//    private page table, also frees the other user pages it maps
+//    and its page table pages (`free_pagetable`); otherwise frees the
+//    unshared pages it owns (`physpages[].owner`). `p` must not be
+//    running, runnable, or waiting. Called by `syscall_exit`. Takes
+//    `ptable_lock`.
+void free_proc(proc* p);
+
+// next_pid(pid)
+//    Return the smallest allocated pid greater than `pid`, or 0 if there
+//    is none. The caller must hold `ptable_lock`. To visit every process:
+//    `for (pid_t pid = next_pid(0); pid; pid = next_pid(pid))`.
+pid_t next_pid(pid_t pid);
+
+
+// Per-CPU state
+//    WeensyOS supports up to MAXCPU processors. Each CPU has its own kernel
+//    stack page; the top of that page is the stack and the bottom holds the
+//    CPU's `cpustate`. CPU `I`'s stack page is the `I+1`th page below
+//    KERNEL_STACK_TOP, so CPU 0 (the boot processor) uses the original
+//    kernel stack. `this_cpu()` finds the running CPU's state from `%rsp`.
+#define MAXCPU                  8
+// Words in a bitmap with one bit per PCID (per physical page; NPAGES / 64)
+#define NPCIDWORDS              8
+
+struct cpustate {
+    // The first 2 members of `cpustate` are used by k-exception.S.
+    proc* current_;                     // process running on this CPU
+    uintptr_t stack_top_;               // top of this CPU's kernel stack
+
+    int index_;                         // CPU number (== local APIC ID)
+
+    spinlock runq_lock_;                // protects run queue
+    proc* runq_head_;                   // run queue of runnable processes
+    proc* runq_tail_;
+
+    // TLB state, one bit per PCID (see `invalidate_tlb`)
+    std::atomic<uint64_t> ran_pcids_[NPCIDWORDS];   // may be in this TLB
+    std::atomic<uint64_t> stale_pcids_[NPCIDWORDS]; // flush before use
+    std::atomic<unsigned> user_pcid_;   // PCID of the user code running
+    std::atomic<bool> in_user_;         // may be running user code
+
+    uint64_t gdt_segments_[7];          // global descriptor table
+    x86_64_taskstate taskstate_;        // task state (kernel stack pointer)
+
+
+    // Initialize this CPU's state (called on the boot CPU for every CPU).
+    void init(int index);
+
+    // Add runnable process `p` to the end of this CPU's run queue.
+    void enqueue(proc* p);
+    // Remove and return the first process on this CPU's run queue, or
+    // return `nullptr` if the queue is empty.
+    proc* dequeue();
+    // Like `dequeue()`, but for another CPU's queue: returns `nullptr`
+    // rather than waiting if that queue's lock is busy.
+    proc* steal();
+};
+
+// Number of CPUs that have started.
+extern std::atomic<int> ncpu;
+
+// cpu_state(i), this_cpu(), current()
+//    Return CPU `i`'s state, the running CPU's state, and the process
+//    running on this CPU. Defined below.
+inline cpustate* cpu_state(int i);
+inline cpustate* this_cpu();
+inline proc* current();
 
 
 // Kernel start address
@@ -47,6 +143,7 @@ extern proc ptable[PID_MAX];
 #define MEMSIZE_PHYSICAL        0x200000
 // Number of physical pages
 #define NPAGES                  (MEMSIZE_PHYSICAL / PAGESIZE)
+static_assert(NPAGES <= 8 * sizeof(proc::shm_refs), "proc::shm_refs too small");
 
 // Virtual memory size
 #define MEMSIZE_VIRTUAL         0x300000
@@ -66,7 +163,17 @@ extern proc ptable[PID_MAX];
 //    You can add more information to `physpageinfo` if you need to.
 //    The memory viewer calls `used()` and `valid()` to check for bugs.
 struct physpageinfo {
-    uint8_t refcount = 0;
+    uint16_t refcount = 0;
+    bool zeroed = false;        // free page known to contain only zeros
+    bool shared = false;        // page created by SYSCALL_SHM_CREATE
+    bool kmalloced = false;     // page holds `kmalloc` memory
+    uint16_t owner = 0;         // pid the page was allocated for, or 0
+
+    // `kmalloc` slab state for pages with `slab_class >= 0`; see k-slab.cc
+    int8_t slab_class = -1;     // object size class
+    uint16_t slab_nfree = 0;    // number of free objects
+    uint16_t slab_free = 0;     // page offset of first free object
+    uint16_t slab_next = 0;     // page number of next partial slab page
 
     bool used() const {
         return this->refcount != 0;
@@ -76,6 +183,8 @@ struct physpageinfo {
     }
 };
 extern physpageinfo physpages[NPAGES];
+// `page_lock` protects `physpages`.
+extern spinlock page_lock;
 
 
 // Segment selectors
@@ -92,6 +201,7 @@ extern physpageinfo physpages[NPAGES];
 #define IRQ_TIMER               0
 #define IRQ_KEYBOARD            1
 #define IRQ_ERROR               19
+#define IRQ_TLB                 20      // TLB shootdown IPI
 #define IRQ_SPURIOUS            31
 
 
@@ -106,10 +216,94 @@ void init_hardware();
 //    timer interrupt if `rate <= 0`.
 void init_timer(int rate);
 
+// boot_aps
+//    Start the other CPUs (application processors). Each one initializes
+//    its hardware, then calls `kernel_ap_start()`. Returns once the CPUs
+//    have started (or a timeout passes).
+void boot_aps();
+
+// kernel_ap_start
+//    Kernel entry point for an application processor. Defined in kernel.cc.
+[[noreturn]] void kernel_ap_start();
+
 
 void* kalloc(size_t sz);
+void* kzalloc(size_t sz);
 void kfree(void* ptr);
 
+// kmalloc(sz)
+//    Allocate `sz` bytes of kernel memory, which need not be a whole page.
+//    Small objects come from per-size slab caches; free with `kfree`.
+//    Returns `nullptr` if `sz > PAGESIZE` or memory is exhausted.
+void* kmalloc(size_t sz);
+
+// slab_free(ptr)
+//    Free a small `kmalloc` object. Called by `kfree`.
+void slab_free(void* ptr);
+
+// slab_reclaim()
+//    Give the empty pages that slab caches keep in reserve back to
+//    `kalloc`. Returns the number of pages freed.
+size_t slab_reclaim();
+
+// refill_zeroed_pool()
+//    Zero one free page for the pre-zeroed pool used by `kzalloc`. Called
+//    when a CPU is idle. Returns false if the pool is full or no free
+//    page needs zeroing.
+bool refill_zeroed_pool();
+
+
+// block_current(wait_list, lock)
+//    Block the current process on `wait_list`, which is linked through
+//    `proc::wait_next` and protected by `lock`, then run another process.
+//    The caller must hold `lock`; `block_current` releases it. The process
+//    later resumes in user mode with `regs.reg_rax` as the system call's
+//    return value. To retry the system call instead, back `regs.reg_rip`
+//    up over the 2-byte `syscall` instruction first.
+[[noreturn]] void block_current(proc*& wait_list, spinlock& lock);
+
+// wake(p), wake_all(wait_list)
+//    Make blocked process `p`, or every process on `wait_list`, runnable.
+//    The caller must hold the lock protecting the wait list.
+void wake(proc* p);
+void wake_all(proc*& wait_list);
+
+
+// pipes (k-pipe.cc)
+int syscall_pipe();
+ssize_t syscall_pipe_read(uintptr_t id, uintptr_t addr, size_t sz);
+ssize_t syscall_pipe_write(uintptr_t id, uintptr_t addr, size_t sz);
+int syscall_pipe_close(uintptr_t id);
+
+// memory-mapped regions (k-mmap.cc)
+//    `vma_fault` handles a fault on an unbacked page in one of `p`'s
+//    regions by mapping a zeroed page; it returns false if `addr` isn't
+//    in a region or memory is exhausted. `vma_populate` faults in every
+//    unbacked region page in [addr, addr + sz), so a system call can
+//    check a buffer with `range_perm`; it returns false if a page is
+//    neither mapped nor in a region, or memory is exhausted.
+//    `vma_release` unmaps and frees all of `p`'s regions.
+uintptr_t syscall_mmap(uintptr_t addr, size_t sz);
+int syscall_munmap(uintptr_t addr, size_t sz);
+bool vma_fault(proc* p, uintptr_t addr);
+bool vma_populate(proc* p, uintptr_t addr, size_t sz);
+void vma_release(proc* p);
+
+// page reclaim (k-reclaim.cc)
+//    `reclaim_pages` frees cached and clean pages when `kalloc` runs out;
+//    it returns the number of pages freed. `reload_text` handles a fault
+//    on a dropped text page by mapping a fresh copy from the process's
+//    program image; it returns false if `addr` isn't reloadable text.
+size_t reclaim_pages();
+bool reload_text(proc* p, uintptr_t addr);
+
+// sampling profiler (k-profile.cc)
+//    While the profiler is on, every timer interrupt on every CPU records
+//    the interrupted %rip and process. `profile_toggle` turns it on, or
+//    turns it off and writes a histogram of samples to `log.txt`.
+void profile_sample(const regstate* regs);
+void profile_toggle();
+
 
 // kernel page table (used for virtual memory)
 extern x86_64_pagetable kernel_pagetable[];
@@ -139,6 +333,32 @@ void check_pagetable(x86_64_pagetable* pagetable);
 //    Change page table after checking it.
 void set_pagetable(x86_64_pagetable* pagetable);
 
+// process_cr3(p)
+//    Return the `%cr3` value that switches to `p`'s page table. When the
+//    CPU supports process-context identifiers, each page table is tagged
+//    with its own PCID (`pagetable_pcid`), so switching back to a
+//    recently-run address space keeps its TLB entries. Called by
+//    k-exception.S on the way to user mode.
+uint64_t process_cr3(proc* p);
+
+// pagetable_pcid(pt)
+//    Return the PCID for page table `pt`: the page number of its root.
+//    Processes sharing `kernel_pagetable` share the kernel's PCID.
+inline unsigned pagetable_pcid(x86_64_pagetable* pt);
+
+// invalidate_tlb(pt)
+//    Note that a present mapping in `pt` was changed or removed, or that
+//    one of its page table pages is being freed. Flushes `pt`'s entries
+//    from this CPU's TLB, and returns only once no other CPU can use a
+//    stale translation from `pt`: other CPUs that have run `pt` flush
+//    before they next load it, and CPUs running user code in `pt` are
+//    interrupted (`IRQ_TLB`). Clear mappings, call `invalidate_tlb`, and
+//    only then free the pages.
+void invalidate_tlb(x86_64_pagetable* pt);
+
+// `%cr3` value for the kernel page table (loaded on kernel entry)
+extern uint64_t kernel_cr3;
+
 // check_page_table_mappings
 //    Check operating system invariants about kernel mappings for a page
 //    table. Panic if any of the invariants are false.
@@ -165,11 +385,30 @@ void syscall_entry();
 //    and 80 * 25.
 void console_show_cursor(int cpos);
 
+#if !WEENSYOS_HEADLESS
 // console_memviewer(vmp)
 //    Show the memory viewer on the console, including the virtual address
-//    space for `vmp`.
+//    space for `vmp`. Only repaints what changed since the last call.
+//    The caller must hold `ptable_lock`.
 void console_memviewer(proc* vmp);
 
+// memviewer_mark_dirty(pa)
+//    Tell the memory viewer that the allocation state of physical page `pa`
+//    changed (for instance, its `physpages` reference count).
+void memviewer_mark_dirty(uintptr_t pa);
+
+// memviewer_mark_remapped()
+//    Tell the memory viewer that page table mappings changed, so it must
+//    re-walk page tables on its next redraw.
+void memviewer_mark_remapped();
+#else
+// Headless kernels (`make HEADLESS=1`) have no memory viewer.
+inline void memviewer_mark_dirty(uintptr_t) {
+}
+inline void memviewer_mark_remapped() {
+}
+#endif
+
 
 // keyboard_readc
 //    Read a character from the keyboard. Returns -1 if there is no character
@@ -193,7 +432,8 @@ int keyboard_readc();
 // check_keyboard
 //    Check for the user typing a control key. 'a', 'f', and 'e' cause a soft
 //    reboot where the kernel runs the allocator programs, "fork", or
-//    "forkexit", respectively. Control-C or 'q' exit the virtual machine.
+//    "forkexit", respectively. 't' dumps the kernel event trace to
+//    `log.txt`. Control-C or 'q' exit the virtual machine.
 //    Returns key typed or -1 for no key.
 int check_keyboard();
 
@@ -337,4 +577,22 @@ template <typename T = void*> inline T pa2kptr(uint64_t pa) {
     return reinterpret_cast<T>(pa);
 }
 
+
+inline cpustate* cpu_state(int i) {
+    return pa2kptr<cpustate*>(KERNEL_STACK_TOP - (i + 1) * PAGESIZE);
+}
+inline cpustate* this_cpu() {
+    // `this_cpu()` is only valid on a kernel stack
+    return pa2kptr<cpustate*>(round_down(rdrsp(), PAGESIZE));
+}
+inline proc* current() {
+    return this_cpu()->current_;
+}
+
+inline unsigned pagetable_pcid(x86_64_pagetable* pt) {
+    static_assert(NPAGES <= 64 * NPCIDWORDS, "NPCIDWORDS too small");
+    static_assert(NPAGES <= CR3_PCIDMASK + 1, "too many pages for PCIDs");
+    return kptr2pa(pt) / PAGESIZE;
+}
+
 #endif
@@ -17,40 +17,88 @@ extern "C" {
 // strtoul, strtol
 //    We must provide our own implementations.
 
+// memcpy, memmove, and memset move 8 bytes at a time with `rep movsq` and
+// `rep stosq`, then finish with `rep movsb` or `rep stosb`. They clear the
+// direction flag themselves, since an exception entry does not.
+//
+// memcmp, memchr, strlen, strnlen, and strchr also examine 8 bytes at a
+// time, in general-purpose registers (kernel and process code is built
+// without SSE). The string functions don't know where their input ends,
+// so they may read past it, but only within an aligned word, which never
+// crosses a page boundary. Those reads are invisible to the sanitizers.
+
+#define SWAR_ONES       0x0101010101010101UL
+#define SWAR_HIGHS      0x8080808080808080UL
+
+// swar_zero(w)
+//    Return a mask whose lowest set bit is the high bit of the first
+//    (least significant) zero byte in `w`, or 0 if `w` has no zero byte.
+//    Bytes after the first zero byte may be misreported.
+static inline uint64_t swar_zero(uint64_t w) {
+    return (w - SWAR_ONES) & ~w & SWAR_HIGHS;
+}
+
+// swar_index(m)
+//    Return the byte index of the lowest set bit in nonzero mask `m`.
+static inline size_t swar_index(uint64_t m) {
+    return __builtin_ctzl(m) / 8;
+}
+
 void* memcpy(void* dst, const void* src, size_t n) {
-    const char* s = (const char*) src;
-    for (char* d = (char*) dst; n > 0; --n, ++s, ++d) {
-        *d = *s;
-    }
+    void* d = dst;
+    size_t nw = n / 8, nb = n % 8;
+    asm volatile("cld; rep movsq; movq %3, %%rcx; rep movsb"
+                 : "+D" (d), "+S" (src), "+c" (nw)
+                 : "r" (nb)
+                 : "memory");
     return dst;
 }
 
 void* memmove(void* dst, const void* src, size_t n) {
     const char* s = (const char*) src;
     char* d = (char*) dst;
-    if (s < d && s + n > d) {
-        s += n, d += n;
-        while (n-- > 0) {
-            *--d = *--s;
-        }
-    } else {
-        while (n-- > 0) {
-            *d++ = *s++;
-        }
-    }
+    if (!(s < d && s + n > d)) {
+        // copying forward is safe
+        return memcpy(dst, src, n);
+    }
+    // overlap with `dst` above `src`: copy backward, last byte first
+    size_t nb = n % 8, nw = n / 8;
+    s += n - 1;
+    d += n - 1;
+    asm volatile("std; rep movsb; subq $7, %%rsi; subq $7, %%rdi;"
+                 " movq %3, %%rcx; rep movsq; cld"
+                 : "+D" (d), "+S" (s), "+c" (nb)
+                 : "r" (nw)
+                 : "memory", "cc");
     return dst;
 }
 
 void* memset(void* v, int c, size_t n) {
-    for (char* p = (char*) v; n > 0; ++p, --n) {
-        *p = c;
-    }
+    void* d = v;
+    uint64_t pattern = (uint8_t) c * 0x0101010101010101UL;
+    size_t nw = n / 8, nb = n % 8;
+    asm volatile("cld; rep stosq; movq %3, %%rcx; rep stosb"
+                 : "+D" (d), "+c" (nw)
+                 : "a" (pattern), "r" (nb)
+                 : "memory");
     return v;
 }
 
 int memcmp(const void* a, const void* b, size_t n) {
     const uint8_t* sa = reinterpret_cast<const uint8_t*>(a);
     const uint8_t* sb = reinterpret_cast<const uint8_t*>(b);
+    // compare a word at a time; in big-endian order, the first differing
+    // byte decides which word is larger
+    for (; n >= 8; sa += 8, sb += 8, n -= 8) {
+        uint64_t wa, wb;
+        __builtin_memcpy(&wa, sa, 8);
+        __builtin_memcpy(&wb, sb, 8);
+        if (wa != wb) {
+            wa = __builtin_bswap64(wa);
+            wb = __builtin_bswap64(wb);
+            return wa < wb ? -1 : 1;
+        }
+    }
     for (; n > 0; ++sa, ++sb, --n) {
         if (*sa != *sb) {
             return (*sa > *sb) - (*sa < *sb);
@@ -60,29 +108,58 @@ int memcmp(const void* a, const void* b, size_t n) {
 }
 
 void* memchr(const void* s, int c, size_t n) {
-    const unsigned char* ss;
-    for (ss = (const unsigned char*) s; n != 0; ++ss, --n) {
-        if (*ss == (unsigned char) c) {
+    const unsigned char* ss = (const unsigned char*) s;
+    unsigned char ch = c;
+    for (; n != 0 && uintptr_t(ss) % 8 != 0; ++ss, --n) {
+        if (*ss == ch) {
+            return (void*) ss;
+        }
+    }
+    uint64_t pattern = ch * SWAR_ONES;
+    for (; n >= 8; ss += 8, n -= 8) {
+        uint64_t m = swar_zero(*(const uint64_t*) ss ^ pattern);
+        if (m) {
+            return (void*) (ss + swar_index(m));
+        }
+    }
+    for (; n != 0; ++ss, --n) {
+        if (*ss == ch) {
             return (void*) ss;
         }
     }
     return nullptr;
 }
 
+[[gnu::no_sanitize_address]]
 size_t strlen(const char* s) {
-    size_t n;
-    for (n = 0; *s != '\0'; ++s) {
-        ++n;
+    const char* p = s;
+    for (; uintptr_t(p) % 8 != 0; ++p) {
+        if (*p == '\0') {
+            return p - s;
+        }
     }
-    return n;
+    uint64_t m;
+    while (!(m = swar_zero(*(const uint64_t*) p))) {
+        p += 8;
+    }
+    return p + swar_index(m) - s;
 }
 
+[[gnu::no_sanitize_address]]
 size_t strnlen(const char* s, size_t maxlen) {
-    size_t n;
-    for (n = 0; n != maxlen && *s != '\0'; ++s) {
-        ++n;
+    size_t n = 0;
+    for (; n != maxlen && uintptr_t(s + n) % 8 != 0; ++n) {
+        if (s[n] == '\0') {
+            return n;
+        }
     }
-    return n;
+    for (; n < maxlen; n += 8) {
+        uint64_t m = swar_zero(*(const uint64_t*) (s + n));
+        if (m) {
+            return min(n + swar_index(m), maxlen);
+        }
+    }
+    return maxlen;
 }
 
 char* strcpy(char* dst, const char* src) {
@@ -158,15 +235,25 @@ int strncasecmp(const char* a, const char* b, size_t n) {
     }
 }
 
+[[gnu::no_sanitize_address]]
 char* strchr(const char* s, int c) {
-    while (*s != '\0' && *s != (char) c) {
-        ++s;
+    // find the first byte equal to `c` or to the terminator
+    for (; uintptr_t(s) % 8 != 0; ++s) {
+        if (*s == (char) c || *s == '\0') {
+            return *s == (char) c ? (char*) s : nullptr;
+        }
     }
-    if (*s == (char) c) {
-        return (char*) s;
-    } else {
-        return nullptr;
+    uint64_t pattern = (unsigned char) c * SWAR_ONES;
+    uint64_t m;
+    while (true) {
+        uint64_t w = *(const uint64_t*) s;
+        if ((m = swar_zero(w) | swar_zero(w ^ pattern))) {
+            break;
+        }
+        s += 8;
     }
+    s += swar_index(m);
+    return *s == (char) c ? (char*) s : nullptr;
 }
 
 char* strstr(const char* hs, const char* ns) {
@@ -341,6 +428,51 @@ int rand(int min, int max) {
 }
 
 
+// crc32c(crc, buf, sz)
+//    Extend CRC-32C (Castagnoli) checksum `crc` with `sz` bytes at `buf`.
+//    Uses the SSE4.2 `crc32` instruction, which works on general-purpose
+//    registers, 8 bytes at a time if the CPU has it. (QEMU's default CPU
+//    model does not.) Otherwise processes a nibble at a time from a
+//    16-entry table.
+
+static const uint32_t crc32c_nibbles[16] = {
+    0x00000000, 0x105EC76F, 0x20BD8EDE, 0x30E349B1,
+    0x417B1DBC, 0x5125DAD3, 0x61C69362, 0x7198540D,
+    0x82F63B78, 0x92A8FC17, 0xA24BB5A6, 0xB21572C9,
+    0xC38D26C4, 0xD3D3E1AB, 0xE330A81A, 0xF36E6F75
+};
+static std::atomic<int> crc32c_hw = -1;     // 1 iff CPU has SSE4.2
+
+uint32_t crc32c(uint32_t crc, const void* buf, size_t sz) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(buf);
+    crc = ~crc;
+    int hw = crc32c_hw.load(std::memory_order_relaxed);
+    if (hw < 0) {
+        hw = (cpuid(1).ecx >> 20) & 1;
+        crc32c_hw.store(hw, std::memory_order_relaxed);
+    }
+    if (hw) {
+        uint64_t crc64 = crc;
+        for (; sz >= 8; p += 8, sz -= 8) {
+            uint64_t w;
+            __builtin_memcpy(&w, p, 8);
+            asm("crc32q %1, %0" : "+r" (crc64) : "rm" (w));
+        }
+        crc = crc64;
+        for (; sz != 0; ++p, --sz) {
+            asm("crc32b %1, %0" : "+r" (crc) : "rm" (*p));
+        }
+    } else {
+        for (; sz != 0; ++p, --sz) {
+            crc ^= *p;
+            crc = (crc >> 4) ^ crc32c_nibbles[crc & 15];
+            crc = (crc >> 4) ^ crc32c_nibbles[crc & 15];
+        }
+    }
+    return ~crc;
+}
+
+
 // declare printfmt specializations (g++-6 requires)
 
 constexpr char printfmt<bool>::spec[];
@@ -645,6 +777,10 @@ console_printer::console_printer(int cpos, bool scroll, int color)
     }
 }
 
+console_printer::~console_printer() {
+    flush();
+}
+
 __noinline
 void console_printer::scroll() {
     assert(cell_ >= console + END_CPOS);
@@ -663,6 +799,7 @@ void console_printer::scroll() {
 
 __noinline
 void console_printer::move_cursor() {
+    flush();
     cursorpos = cell_ - console;
 #if WEENSYOS_KERNEL
     extern void console_show_cursor(int);
@@ -671,20 +808,35 @@ void console_printer::move_cursor() {
 }
 
 void console_printer::putc(unsigned char c) {
-    while (cell_ >= console + END_CPOS) {
-        scroll();
+    if (nline_ == 0) {
+        while (cell_ >= console + END_CPOS) {
+            scroll();
+        }
     }
+    unsigned pos = (cell_ - console) % CONSOLE_COLUMNS + nline_;
     if (c == '\n') {
-        int pos = (cell_ - console) % 80;
-        while (pos != 80) {
-            *cell_++ = ' ' | color_;
+        while (pos != CONSOLE_COLUMNS) {
+            line_[nline_++] = ' ' | color_;
             ++pos;
         }
     } else {
-        *cell_++ = c | color_;
+        line_[nline_++] = c | color_;
+        ++pos;
+    }
+    // The buffer never crosses a row, so scrolling happens between rows.
+    if (pos == CONSOLE_COLUMNS) {
+        flush();
     }
 }
 
+__noinline
+void console_printer::flush() {
+    // one bulk copy into CGA memory
+    memcpy(const_cast<uint16_t*>(cell_), line_, nline_ * sizeof(line_[0]));
+    cell_ += nline_;
+    nline_ = 0;
+}
+
 __noinline
 int console_puts(int cpos, int color, const char* s, size_t len) {
     console_printer cp(cpos, cpos < 0, color);
@@ -693,6 +845,7 @@ int console_puts(int cpos, int color, const char* s, size_t len) {
         ++s;
         --len;
     }
+    cp.flush();
     if (cpos < 0) {
         cp.move_cursor();
     }
@@ -707,6 +860,7 @@ __noinline
 int console_vprintf(int cpos, int color, const char* format, va_list val) {
     console_printer cp(cpos, cpos < 0, color);
     cp.vprintf(format, val);
+    cp.flush();
     if (cpos < 0) {
         cp.move_cursor();
     }
@@ -221,6 +221,34 @@ inline uint32_t crc32c(const void* buf, size_t sz) {
 #define SYSCALL_PAGE_ALLOC      4
 #define SYSCALL_FORK            5
 #define SYSCALL_EXIT            6
+#define SYSCALL_SLEEP           7
+#define SYSCALL_SHM_CREATE      8
+#define SYSCALL_SHM_ATTACH      9
+#define SYSCALL_PIPE            10
+#define SYSCALL_PIPE_READ       11
+#define SYSCALL_PIPE_WRITE      12
+#define SYSCALL_GETTICKS        13
+#define SYSCALL_WRITE           14
+#define SYSCALL_GETSTATS        15
+#define SYSCALL_MMAP            16
+#define SYSCALL_MUNMAP          17
+#define SYSCALL_LOG             18
+#define SYSCALL_PIPE_CLOSE      19
+
+// Number of system call numbers counted in `proc_stats::nsyscalls`
+#define NSYSCALLS               32
+
+
+// Per-process resource usage, as returned by `sys_getstats`
+
+struct proc_stats {
+    unsigned long ticks;                // timer interrupts while running
+    unsigned long nswitches;            // times scheduled after another
+                                        // process (or idle) ran
+    unsigned long nfaults;              // user page faults
+    unsigned long npages;               // physical pages allocated for it
+    unsigned long nsyscalls[NSYSCALLS]; // system calls by number
+};
 
 
 // System call error return values
@@ -238,9 +266,11 @@ inline bool is_error(uintptr_t r) {
 
 
 // Maximum number of processes
+//    The memory viewer has letters and flag bits for pids 1-28 only;
+//    pages of pids 29 and up all display as '?'.
 
 #ifndef PID_MAX
-#define PID_MAX         16
+#define PID_MAX         512
 #endif
 
 
@@ -316,11 +346,18 @@ struct printer {
     void vprintf(const char* format, va_list val);
 };
 
+// `console_printer` collects characters in `line_` and copies them to the
+// console a row at a time, on newline, or on `flush()`. `cell_` is where
+// the buffered characters will go; call `flush()` before reading it.
 struct console_printer : public printer {
     volatile uint16_t* cell_;
     bool scroll_;
+    unsigned nline_ = 0;
+    uint16_t line_[CONSOLE_COLUMNS];
     console_printer(int cpos, bool scroll, int color = COLOR_NORMAL);
+    ~console_printer();
     void putc(unsigned char c) override;
+    void flush();
     void scroll();
     void move_cursor();
 };
@@ -58,6 +58,6 @@ void process_main() {
 
     // After running out of memory, do nothing forever
     while (true) {
-        sys_yield();
+        sys_sleep(100);
     }
 }
@@ -0,0 +1,179 @@
+#include "u-lib.hh"
+#include <atomic>
+
+// p-bench: kernel microbenchmarks.
+// Times, with `rdtsc`, a null system call, a page fault on a `sys_mmap`
+// region, a context switch, a pipe transfer, and a fork+exit round trip,
+// and writes one `bench:` line per result to `log.txt`. `make run-bench`
+// runs p-bench without a display and prints its results.
+//
+// The kernel's `bench` command starts two processes: p-bench (pid 1)
+// runs the benchmarks, and p-bench2 (pid 2, the same program linked at
+// 0x140000) yields back to it in the context switch benchmark and
+// writes to it in the pipe benchmark. They meet in a shared memory page
+// and talk through pipes. Only fork+exit needs `sys_fork`, so it runs
+// last. Context switch times are only meaningful with NCPU=1.
+
+#define NSYSCALL        10000           // null system calls
+#define NFAULT          64              // pages faulted in
+#define NSWITCH         1000            // yields per process
+#define NPIPE           256             // pipe chunks transferred
+#define PIPE_CHUNK      4096            // bytes per pipe read or write
+#define NFORK           100             // fork+exit round trips
+
+#define SHARED_ADDR     0x2FF000        // last page below MEMSIZE_VIRTUAL
+
+struct shared_state {
+    std::atomic<int> shm_id;            // shared memory ID, set by creator
+    std::atomic<bool> ready;            // set once the pipes are created
+    int to_partner;                     // pipe: commands for p-bench2
+    int to_main;                        // pipe: replies to p-bench
+};
+
+static uint8_t buf[PIPE_CHUNK];
+
+static void report(const char* name, uint64_t cycles, unsigned long n) {
+    log_printf("bench: %-12s %8lu cycles/op (%lu ops)\n",
+               name, (unsigned long) (cycles / n), n);
+}
+
+// rendezvous()
+//    Return the page p-bench and p-bench2 share. Whichever process gets
+//    there first creates it, and the other attaches to it. (Processes
+//    share one page table, so both see the page as soon as it exists.)
+
+static shared_state* rendezvous() {
+    shared_state* sh = (shared_state*) SHARED_ADDR;
+    int id = sys_shm_create(sh);
+    if (id >= 0) {
+        sh->shm_id.store(id, std::memory_order_release);
+        return sh;
+    }
+    assert(id == E_INVAL);
+    while ((id = sh->shm_id.load(std::memory_order_acquire)) == 0) {
+        sys_yield();
+    }
+    int r = sys_shm_attach(id, sh);
+    assert(r == 0);
+    return sh;
+}
+
+// partner(sh)
+//    p-bench2's loop: follow p-bench's commands until it closes the
+//    command pipe.
+
+static void partner(shared_state* sh) {
+    while (!sh->ready.load(std::memory_order_acquire)) {
+        sys_yield();
+    }
+    while (true) {
+        char cmd;
+        if (sys_pipe_read(sh->to_partner, &cmd, 1) != 1) {
+            return;
+        }
+        if (cmd == 's') {
+            for (int i = 0; i != NSWITCH; ++i) {
+                sys_yield();
+            }
+            sys_pipe_write(sh->to_main, "", 1);
+        } else if (cmd == 'p') {
+            // write a byte pattern for `bench_pipe` to check
+            for (size_t pos = 0; pos != NPIPE * PIPE_CHUNK; ) {
+                for (size_t i = 0; i != PIPE_CHUNK; ++i) {
+                    buf[i] = (pos + i) % 251;
+                }
+                ssize_t n = sys_pipe_write(sh->to_main, buf, PIPE_CHUNK);
+                assert(n > 0);
+                pos += n;
+            }
+        }
+    }
+}
+
+static void bench_syscall() {
+    uint64_t t0 = rdtsc();
+    for (int i = 0; i != NSYSCALL; ++i) {
+        sys_getpid();
+    }
+    report("syscall", rdtsc() - t0, NSYSCALL);
+}
+
+static void bench_fault() {
+    volatile uint8_t* region = (uint8_t*) sys_mmap(nullptr, NFAULT * PAGESIZE);
+    assert(!is_error((uintptr_t) region));
+    uint64_t t0 = rdtsc();
+    for (int i = 0; i != NFAULT; ++i) {
+        region[i * PAGESIZE] = 1;
+    }
+    report("page fault", rdtsc() - t0, NFAULT);
+    int r = sys_munmap((void*) region, NFAULT * PAGESIZE);
+    assert(r == 0);
+}
+
+static void bench_switch(shared_state* sh) {
+    sys_pipe_write(sh->to_partner, "s", 1);
+    uint64_t t0 = rdtsc();
+    for (int i = 0; i != NSWITCH; ++i) {
+        sys_yield();
+    }
+    // each yield switches to the partner and back
+    report("switch", rdtsc() - t0, 2 * NSWITCH);
+    char c;
+    sys_pipe_read(sh->to_main, &c, 1);
+}
+
+static void bench_pipe(shared_state* sh) {
+    sys_pipe_write(sh->to_partner, "p", 1);
+    uint64_t t0 = rdtsc();
+    for (size_t pos = 0; pos != NPIPE * PIPE_CHUNK; ) {
+        ssize_t n = sys_pipe_read(sh->to_main, buf, PIPE_CHUNK);
+        assert(n > 0);
+        for (ssize_t i = 0; i != n; ++i) {
+            assert(buf[i] == (pos + i) % 251);
+        }
+        pos += n;
+    }
+    report("pipe 4KiB", rdtsc() - t0, NPIPE);
+}
+
+static void bench_fork(int done) {
+    uint64_t t0 = rdtsc();
+    for (int i = 0; i != NFORK; ++i) {
+        pid_t p = sys_fork();
+        assert(p >= 0);
+        if (p == 0) {
+            sys_pipe_write(done, "", 1);
+            sys_exit();
+        }
+        char c;
+        sys_pipe_read(done, &c, 1);
+    }
+    report("fork+exit", rdtsc() - t0, NFORK);
+}
+
+void process_main() {
+    shared_state* sh = rendezvous();
+    if (sys_getpid() != 1) {
+        partner(sh);
+        sys_exit();
+    }
+
+    sh->to_partner = sys_pipe();
+    sh->to_main = sys_pipe();
+    assert(sh->to_partner >= 0 && sh->to_main >= 0);
+    sh->ready.store(true, std::memory_order_release);
+
+    bench_syscall();
+    bench_fault();
+    bench_switch(sh);
+    bench_pipe(sh);
+    // closing the command pipe makes p-bench2 exit
+    sys_pipe_close(sh->to_partner);
+    bench_fork(sh->to_main);
+    sys_pipe_close(sh->to_main);
+
+    log_printf("bench: done\n");
+    while (true) {
+        sys_sleep(100);
+    }
+}
@@ -0,0 +1,41 @@
+#include "u-lib.hh"
+
+// p-mmap: lazily backed `sys_mmap` regions.
+// Reserves a large region, touches a few of its pages, and checks that
+// only those pages were allocated. Then unmaps the region and maps it
+// again, checking that the new pages start out zero.
+
+#define REGION_SIZE     (128 * PAGESIZE)
+#define TOUCH_STRIDE    (16 * PAGESIZE)
+
+static unsigned long pages_owned() {
+    proc_stats st;
+    int r = sys_getstats(sys_getpid(), &st);
+    assert(r == 0);
+    return st.npages;
+}
+
+void process_main() {
+    for (unsigned round = 1; true; ++round) {
+        unsigned long before = pages_owned();
+        uint8_t* region = (uint8_t*) sys_mmap(nullptr, REGION_SIZE);
+        assert(!is_error((uintptr_t) region));
+        assert(pages_owned() == before);
+
+        for (size_t off = 0; off < REGION_SIZE; off += TOUCH_STRIDE) {
+            assert(region[off] == 0 && region[off + PAGESIZE - 1] == 0);
+            region[off] = round;
+        }
+        unsigned long touched = REGION_SIZE / TOUCH_STRIDE;
+        assert(pages_owned() == before + touched);
+
+        int r = sys_munmap(region, REGION_SIZE);
+        assert(r == 0);
+        assert(pages_owned() == before);
+
+        console_printf(CPOS(24, 0), 0x0F00,
+                       "p-mmap: round %u: %lu of %lu pages faulted in\n",
+                       round, touched, REGION_SIZE / PAGESIZE);
+        sys_sleep(50);
+    }
+}
@@ -15,6 +15,18 @@ void panic(const char* format, ...) {
     sys_panic(buf);
 }
 
+// log_printf(format, ...)
+//     Format a message and send it to `log.txt` with SYSCALL_LOG.
+
+void log_printf(const char* format, ...) {
+    va_list val;
+    va_start(val, format);
+    char buf[240];
+    int len = vsnprintf(buf, sizeof(buf), format, val);
+    va_end(val);
+    sys_log(buf, min(len, int(sizeof(buf)) - 1));
+}
+
 void error_vprintf(int cpos, int color, const char* format, va_list val) {
     console_vprintf(cpos, color, format, val);
 }
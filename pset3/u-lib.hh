@@ -89,6 +89,13 @@ inline void sys_yield() {
     make_syscall(SYSCALL_YIELD);
 }
 
+// sys_sleep(ticks)
+//    Block this process for at least `ticks` timer interrupts. Unlike a
+//    `sys_yield` loop, a sleeping process uses no CPU time. Returns 0.
+inline int sys_sleep(unsigned ticks) {
+    return make_syscall(SYSCALL_SLEEP, ticks);
+}
+
 // sys_page_alloc(addr)
 //    Allocate a page of memory at address `addr` for this process. The
 //    newly-allocated memory is initialized to 0. Any memory previously
@@ -103,6 +110,108 @@ inline int sys_page_alloc(void* addr) {
     return make_syscall(SYSCALL_PAGE_ALLOC, (uintptr_t) addr);
 }
 
+// sys_shm_create(addr)
+//    Allocate a zero-filled page of memory that other processes can
+//    share, and map it at address `addr` in this process. Returns a
+//    nonnegative shared memory ID on success, or a negative error code.
+//    The page is freed when the last process using it exits.
+//
+//    `Addr` must be page-aligned, >= PROC_START_ADDR, < MEMSIZE_VIRTUAL,
+//    and not currently mapped.
+inline int sys_shm_create(void* addr) {
+    return make_syscall(SYSCALL_SHM_CREATE, (uintptr_t) addr);
+}
+
+// sys_shm_attach(id, addr)
+//    Map the shared page with ID `id` at address `addr` in this process.
+//    Writes through any mapping are visible through all the others.
+//    Returns 0 on success or a negative error code. `Addr` has the same
+//    requirements as for `sys_shm_create`.
+//
+//    While processes share one page table, every shared page is already
+//    mapped in every process, at the address where it was created. `Addr`
+//    must be that address; attaching keeps the page until this process
+//    exits, too.
+inline int sys_shm_attach(int id, void* addr) {
+    return make_syscall(SYSCALL_SHM_ATTACH, id, (uintptr_t) addr);
+}
+
+// sys_pipe()
+//    Create a pipe. Returns a nonnegative pipe ID on success, or a negative
+//    error code.
+inline int sys_pipe() {
+    return make_syscall(SYSCALL_PIPE);
+}
+
+// sys_pipe_read(id, buf, sz)
+//    Read up to `sz` bytes from pipe `id` into `buf`. Blocks until the pipe
+//    holds data. Returns the number of bytes read, or a negative error code.
+inline ssize_t sys_pipe_read(int id, void* buf, size_t sz) {
+    return make_syscall(SYSCALL_PIPE_READ, id, (uintptr_t) buf, sz);
+}
+
+// sys_pipe_write(id, buf, sz)
+//    Write up to `sz` bytes from `buf` to pipe `id`. Blocks until the pipe
+//    has room. Returns the number of bytes written, which may be less than
+//    `sz`, or a negative error code.
+inline ssize_t sys_pipe_write(int id, const void* buf, size_t sz) {
+    return make_syscall(SYSCALL_PIPE_WRITE, id, (uintptr_t) buf, sz);
+}
+
+// sys_pipe_close(id)
+//    Destroy pipe `id`, discarding any unread data. Processes blocked on
+//    it wake up, and their reads or writes fail. Returns 0 on success or a
+//    negative error code. The ID may be reused by a later `sys_pipe`.
+inline int sys_pipe_close(int id) {
+    return make_syscall(SYSCALL_PIPE_CLOSE, id);
+}
+
+// sys_getticks()
+//    Return the number of timer interrupts since boot.
+inline unsigned long sys_getticks() {
+    return make_syscall(SYSCALL_GETTICKS);
+}
+
+// sys_write(buf, sz)
+//    Print `sz` bytes from `buf` to the console at the cursor, scrolling
+//    as needed. Returns `sz` on success or a negative error code. One call
+//    is much cheaper than printing the bytes one at a time.
+inline ssize_t sys_write(const char* buf, size_t sz) {
+    return make_syscall(SYSCALL_WRITE, (uintptr_t) buf, sz);
+}
+
+// sys_getstats(pid, stats)
+//    Store process `pid`'s resource usage in `*stats`. Returns 0 on
+//    success, or a negative error code if there is no process `pid`.
+inline int sys_getstats(pid_t pid, proc_stats* stats) {
+    return make_syscall(SYSCALL_GETSTATS, pid, (uintptr_t) stats);
+}
+
+// sys_mmap(addr, sz)
+//    Reserve a zero-filled, writable region of `sz` bytes (rounded up to
+//    whole pages) and return its address, or a negative error code.
+//    If `addr` is nullptr, the kernel chooses the address; otherwise the
+//    region starts at `addr`, which must be page-aligned and unused.
+//    Physical pages are allocated only when first touched.
+inline void* sys_mmap(void* addr, size_t sz) {
+    return (void*) make_syscall(SYSCALL_MMAP, (uintptr_t) addr, sz);
+}
+
+// sys_munmap(addr, sz)
+//    Remove the pages in [addr, addr + sz) from this process's `sys_mmap`
+//    regions and free them. `addr` must be page-aligned. Returns 0 or a
+//    negative error code.
+inline int sys_munmap(void* addr, size_t sz) {
+    return make_syscall(SYSCALL_MUNMAP, (uintptr_t) addr, sz);
+}
+
+// sys_log(buf, sz)
+//    Append `sz` bytes from `buf` to the host's `log.txt` file. Returns
+//    `sz` on success or a negative error code.
+inline ssize_t sys_log(const char* buf, size_t sz) {
+    return make_syscall(SYSCALL_LOG, (uintptr_t) buf, sz);
+}
+
 // sys_fork()
 //    Fork the current process. On success, returns the child's process ID to
 //    the parent, and returns 0 to the child. On failure, returns a negative
@@ -122,6 +231,11 @@ inline pid_t sys_fork() {
     }
 }
 
+// log_printf(format, ...)
+//    Print a message to the host's `log.txt` file using `sys_log`.
+//    Messages are truncated to 240 characters.
+void log_printf(const char* format, ...);
+
 // sys_panic(msg)
 //    Panic.
 [[noreturn]] inline void sys_panic(const char* msg) {
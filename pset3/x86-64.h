@@ -15,6 +15,7 @@
 #define PAGEOFFBITS     12                     // # bits in page offset
 #define PAGEINDEXBITS   9                      // # bits in a page index level
 #define PAGESIZE        (1UL << PAGEOFFBITS)   // Size of page in bytes
+#define LARGEPAGESIZE   (PAGESIZE << PAGEINDEXBITS) // Size of large page
 #define PAGEOFFMASK     (PAGESIZE - 1)
 
 // Permission flags: define whether page is accessible
@@ -179,6 +180,11 @@ typedef struct x86_64_msr_t {
 #define CR4_PCE                 0x00000100      // Perfmonitor Counter Enable
 #define CR4_OSFXSR              0x00000200      // OS FXSAVE/FXRSTOR support
 #define CR4_VMXE                0x00004000      // VMX Enable
+#define CR4_PCIDE               0x00020000      // Process-Context IDs Enable
+
+// %cr3 bits (with CR4_PCIDE)
+#define CR3_PCIDMASK            0x0000000000000FFFUL // process-context ID
+#define CR3_NOFLUSH             0x8000000000000000UL // keep PCID's TLB entries
 
 // eflags bits (useful for rdeflags() and wreflags())
 #define EFLAGS_CF               0x00000001      // Carry Flag
@@ -341,6 +347,16 @@ __always_inline void tlbflush() {
     asm volatile("movq %0, %%cr3" : : "r" (x));
 }
 
+// invpcid(type, pcid)
+//    Invalidate TLB entries for process-context ID `pcid` (with
+//    INVPCID_SINGLE) or for all PCIDs. Needs CPUID.(EAX=7):EBX[10].
+#define INVPCID_SINGLE          1       // one PCID, except global pages
+#define INVPCID_ALL             3       // every PCID, except global pages
+__always_inline void invpcid(uint64_t type, uint64_t pcid) {
+    struct { uint64_t pcid, addr; } desc = { pcid, 0 };
+    asm volatile("invpcid %0, %1" : : "m" (desc), "r" (type) : "memory");
+}
+
 __always_inline uint32_t rdeflags() {
     uint64_t x;
     asm volatile("pushfq; popq %0" : "=rm" (x) : : "memory");